@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,6 +9,8 @@
 #include "ll.h"
 #include "parse.h"
 #include "undo.h"
+#include "ed.h"
+#include "ses.h"
 
 #define REPLIM 200
 
@@ -39,6 +42,8 @@ typedef struct ds_t{
 	char *s;
 	size_t sz;
 	int nmemb;
+	/* A realloc() failed, whatever didn't fit was dropped */
+	_Bool failed;
 } ds_t;
 
 ds_t *ds_make() {
@@ -46,6 +51,7 @@ ds_t *ds_make() {
 	ds->s = NULL;
 	ds->sz = 0;
 	ds->nmemb = 0;
+	ds->failed = 0;
 	return ds;
 }
 
@@ -57,8 +63,7 @@ void ds_set(ds_t *obj, char *s) {
 	if (sz > obj->sz) {
 		obj->s = realloc(obj->s, (sz+1) * sizeof(*(obj->s)));
 	}
-	strncpy(obj->s, s, sz);
-	obj->s[sz] = '\0';
+	memcpy(obj->s, s, sz + 1);
 	obj->sz = sz;
 #if 0
 	if (obj->s[sz - 1] == '\n') {
@@ -91,8 +96,13 @@ void ds_free(ds_t *obj) {
 
 void ds_append(ds_t *ds, char c) {
 	size_t sz = (ds->sz == 0 ? 1 : ds->sz);
-	if (ds->nmemb >= (int)ds->sz) {
-		ds->s = realloc(ds->s, (sz * 2) * sizeof(*(ds->s)));
+	if (ds->nmemb + 1 >= (int)ds->sz) {
+		char *s = realloc(ds->s, (sz * 2) * sizeof(*(ds->s)));
+		if (s == NULL) {
+			ds->failed = 1;
+			return;
+		}
+		ds->s = s;
 		ds->sz = sz * 2;
 	}
 	ds->s[ds->nmemb] = c;
@@ -115,6 +125,29 @@ void ds_cat_e(ds_t *ds, char *sp, char *ep) {
 	}
 }
 
+void ds_cat_n(ds_t *ds, char *s, size_t n) {
+	if (ds->nmemb + n + 1 > ds->sz) {
+		size_t sz = (ds->sz == 0 ? 1 : ds->sz);
+		while (ds->nmemb + n + 1 > sz) {
+			sz *= 2;
+		}
+		char *p = realloc(ds->s, sz * sizeof(*(ds->s)));
+		if (p == NULL) {
+			ds->failed = 1;
+			return;
+		}
+		ds->s = p;
+		ds->sz = sz;
+	}
+	memcpy(ds->s + ds->nmemb, s, n);
+	ds->nmemb += n;
+	ds->s[ds->nmemb] = '\0';
+}
+
+_Bool ds_failed(ds_t *ds) {
+	return ds->failed;
+}
+
 char ds_pop(ds_t *ds) {
 	if (ds->nmemb == 0) {
 		return '\0';
@@ -200,6 +233,20 @@ size_t yb_nmembs(yb_t *yb) {
 
 typedef struct re_t{
 	regex_t re;
+	/* Pattern and flags 're' was compiled from, used by re_clone() */
+	char *pattern;
+	int cflags;
+	/* A string every match must contain, NULL if none is known */
+	char *literal;
+	/* 
+	 * If the whole pattern is a plain string, optionally anchored, that
+	 * string and its anchors, so it can be matched without regexec()
+	 */
+	char *fixed;
+	size_t fixed_len;
+	int anchor;
+	/* Ignore case (the 'I' flag), 'literal' and 'fixed' are then lower case */
+	_Bool icase;
 	ds_t *subst;
 	_Bool global;
 	_Bool print;
@@ -209,6 +256,10 @@ typedef struct re_t{
 
 re_t *re_make() {
 	re_t *re = calloc(1, sizeof(*re));
+	re->pattern = NULL;
+	re->literal = NULL;
+	re->fixed = NULL;
+	re->icase = 0;
 	re->global = 0;
 	re->print = 0;
 	re->number = 0;
@@ -220,6 +271,12 @@ void re_free(re_t *re) {
 	if (re->subst != NULL) {
 		ds_free(re->subst);
 	}
+	if (re->pattern != NULL) {
+		regfree(&re->re);
+		free(re->pattern);
+	}
+	free(re->literal);
+	free(re->fixed);
 }
 
 
@@ -227,6 +284,16 @@ ds_t *re_get_subst(re_t *re) {
 	return re->subst;
 }
 
+void re_set_subst(re_t *re, char *subst) {
+	if (re->subst == NULL) {
+		re->subst = ds_make();
+	}
+	ds_clear(re->subst);
+	while (subst != NULL && *subst) {
+		ds_append(re->subst, *subst++);
+	}
+}
+
 int re_has_subst(re_t *re) {
 	return !(re->subst == NULL);
 }
@@ -238,56 +305,406 @@ int re_has_subst(re_t *re) {
 #define NMATCH 200
 regmatch_t pmatch[NMATCH];
 
-void parse_regex(re_t *re, char *exp) {
-	if (exp == NULL) {
-		return;
+/*
+ * Return (malloc'ed) the longest run of plain characters in the regex 'exp' 
+ * that any match has to contain, or NULL. Every line is still visited:
+ * re_match_r() only rejects the ones without the literal with a strstr()
+ * before regexec() sees them. Skipping lines without reading them is left
+ * to the block filters of ll.c, which are fed the same literal.
+ *
+ * The scan is conservative. Anything inside a group or a bracket expression
+ * is ignored, a character followed by a quantifier is dropped and 
+ * alternation anywhere gives up altogether.
+ */
+static char *required_literal(char *exp, _Bool extended) {
+	size_t len = strlen(exp);
+	char *run = malloc(len + 1);
+	char *best = malloc(len + 1);
+	if (run == NULL || best == NULL) {
+		free(run);
+		free(best);
+		return NULL;
+	}
+	size_t run_sz = 0;
+	size_t best_sz = 0;
+	int depth = 0;
+	char c;
+
+	for (char *p = exp; ; ++p) {
+		c = *p;
+		_Bool literal = 0;
+		_Bool quantifier = 0;
+		if (c == '\\' && p[1] != '\0') {
+			c = *++p;
+			if (strchr(".[]*^$\\/", c) != NULL || (extended && strchr("()+?{}|", c) != NULL)) {
+				literal = 1;
+			}
+			else if (!extended && (c == '+' || c == '?' || c == '{')) {
+				quantifier = 1;
+			}
+			else if (!extended && c == '(') {
+				depth++;
+			}
+			else if (!extended && c == ')') {
+				depth--;
+			}
+			else if (!extended && c == '|') {
+				goto none;
+			}
+		}
+		else if (c == '*' || (extended && (c == '+' || c == '?' || c == '{'))) {
+			quantifier = 1;
+		}
+		else if (extended && c == '|') {
+			goto none;
+		}
+		else if (extended && c == '(') {
+			depth++;
+		}
+		else if (extended && c == ')') {
+			depth--;
+		}
+		else if (c == '[') {
+			/* Skip the bracket expression, a ']' right after '[' or '[^' is literal */
+			p++;
+			p += (*p == '^');
+			p += (*p == ']');
+			while (*p && *p != ']') {
+				if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+					char close = p[1];
+					for (p += 2; *p && !(*p == close && p[1] == ']'); ++p)
+						;
+					p += (*p != '\0');
+				}
+				p += (*p != '\0');
+			}
+			if (*p == '\0') {
+				goto none;
+			}
+		}
+		else if (c != '\0' && c != '.' && c != '^' && c != '$') {
+			literal = 1;
+		}
+
+		if (literal && depth == 0) {
+			run[run_sz++] = c;
+			continue;
+		}
+		if (quantifier && run_sz > 0) {
+			run_sz--;
+		}
+		if (quantifier && c == '{') {
+			/* Skip the interval, up to '}' or '\}' */
+			while (*p && *p != '}') {
+				p++;
+			}
+			if (*p == '\0') {
+				goto none;
+			}
+		}
+		if (run_sz > best_sz) {
+			memcpy(best, run, run_sz);
+			best_sz = run_sz;
+		}
+		run_sz = 0;
+		if (c == '\0') {
+			break;
+		}
+	}
+	free(run);
+	if (best_sz == 0) {
+		free(best);
+		return NULL;
 	}
+	best[best_sz] = '\0';
+	return best;
+none:
+	free(run);
+	free(best);
+	return NULL;
+}
+
+/* Anchors of a fixed pattern */
+#define ANCHOR_BOL 1
+#define ANCHOR_EOL 2
+
+/*
+ * If the regex 'exp' is nothing but plain characters, with an optional '^'
+ * in front and '$' at the end, return (malloc'ed) those characters and set 
+ * 'anchor'. Otherwise return NULL.
+ */
+static char *fixed_pattern(char *exp, _Bool extended, int *anchor) {
+	char *fixed = malloc(strlen(exp) + 1);
+	if (fixed == NULL) {
+		return NULL;
+	}
+	char *f = fixed;
+	*anchor = 0;
+	if (*exp == '^') {
+		*anchor |= ANCHOR_BOL;
+		exp++;
+	}
+	for (; *exp; ++exp) {
+		if (*exp == '$' && exp[1] == '\0') {
+			*anchor |= ANCHOR_EOL;
+			break;
+		}
+		if (*exp == '\\') {
+			exp++;
+			if (!(strchr(".[]*^$\\/", *exp) != NULL || 
+					(extended && strchr("()+?{}|", *exp) != NULL))) {
+				goto none;
+			}
+		}
+		else if (strchr(".[*^$", *exp) != NULL || 
+				(extended && strchr("()+?{|", *exp) != NULL)) {
+			goto none;
+		}
+		*f++ = *exp;
+	}
+	*f = '\0';
+	return fixed;
+none:
+	free(fixed);
+	return NULL;
+}
+
+/* ASCII only case folding for the strings of an 'I' regex */
+#define FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+/* 
+ * Fold 's' to lower case in place. Return 0 if it has bytes outside ASCII,
+ * whose case only the regex library knows how to fold.
+ */
+static int fold_ascii(char *s) {
+	for (; *s; ++s) {
+		if ((unsigned char)*s >= 0x80) {
+			return 0;
+		}
+		*s = FOLD(*s);
+	}
+	return 1;
+}
+
+/* Compare 'n' bytes of 'line' with 'lit', folding 'line' if 'icase' */
+static int lit_eq(char *line, char *lit, size_t n, _Bool icase) {
+	if (!icase) {
+		return memcmp(line, lit, n) == 0;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (FOLD(line[i]) != lit[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* strstr() of 'lit', 'n' bytes long, in 'line', folding 'line' if 'icase' */
+static char *lit_find(char *line, char *lit, size_t n, _Bool icase) {
+	if (!icase) {
+		return strstr(line, lit);
+	}
+	if (n == 0) {
+		return line;
+	}
+	/* Let strpbrk() find the candidates, in either case */
+	char first[3] = { *lit, toupper((unsigned char)*lit), '\0' };
+	while ((line = strpbrk(line, first)) != NULL) {
+		if (lit_eq(line + 1, lit + 1, n - 1, 1)) {
+			return line;
+		}
+		line++;
+	}
+	return NULL;
+}
+
+/* 
+ * Match the fixed pattern of 're' against 'line', 'len' bytes long, 
+ * honouring REG_NOTBOL in 'eflags'. Return the offset of the match or -1.
+ * Like regexec(), strstr() and the search filters, it only sees the line 
+ * up to its first NUL.
+ */
+static regoff_t fixed_match(re_t *re, char *line, size_t len, int eflags) {
+	size_t n = re->fixed_len;
+	char *at = NULL;
+	len = strnlen(line, len);
+	/* '$' matches before the newline that ends a line */
+	if (len > 0 && line[len - 1] == '\n') {
+		len--;
+	}
+	if ((re->anchor & ANCHOR_BOL) && (eflags & REG_NOTBOL)) {
+		return -1;
+	}
+	switch (re->anchor) {
+		case ANCHOR_BOL:
+			at = (len >= n && lit_eq(line, re->fixed, n, re->icase) ? line : NULL);
+			break;
+		case ANCHOR_EOL:
+			at = (len >= n && lit_eq(line + len - n, re->fixed, n, re->icase) ? 
+					line + len - n : NULL);
+			break;
+		case ANCHOR_BOL | ANCHOR_EOL:
+			at = (len == n && lit_eq(line, re->fixed, n, re->icase) ? line : NULL);
+			break;
+		default:
+			at = lit_find(line, re->fixed, n, re->icase);
+			break;
+	}
+	return (at == NULL ? -1 : at - line);
+}
+
+/* Compile 'exp' into 're' with 'cflags' */
+static void re_compile(re_t *re, char *exp, int cflags) {
+	if (re->pattern != NULL) {
+		regfree(&re->re);
+		free(re->pattern);
+		re->pattern = NULL;
+	}
+	free(re->literal);
+	re->literal = NULL;
+	free(re->fixed);
+	re->fixed = NULL;
 	int err;
-	if ((err = regcomp(&re->re, exp, (opt_extended ? REG_EXTENDED : 0))) != 0) {
+	if ((err = regcomp(&re->re, exp, cflags)) != 0) {
 		err_normal(&to_repl, "%s\n", regerror_aux(err, &re->re));
 	}
+	re->pattern = strdup(exp);
+	re->cflags = cflags;
+	re->literal = required_literal(exp, cflags & REG_EXTENDED);
+	re->fixed = fixed_pattern(exp, cflags & REG_EXTENDED, &re->anchor);
+	if (re->icase && re->literal != NULL && !fold_ascii(re->literal)) {
+		free(re->literal);
+		re->literal = NULL;
+	}
+	if (re->icase && re->fixed != NULL && !fold_ascii(re->fixed)) {
+		free(re->fixed);
+		re->fixed = NULL;
+	}
+	re->fixed_len = (re->fixed == NULL ? 0 : strlen(re->fixed));
 }
 
-void parse_subst(re_t *re, char *line, char *exp) {
+void parse_regex(re_t *re, char *exp) {
 	if (exp == NULL) {
-		exp = ds_get_s(re->subst);
+		return;
 	}
-	int err;
-	if ((err = regexec(&re->re, line, NMATCH, pmatch, 0)) != 0) { 
-		pmatch[0].rm_so = -1;
-		pmatch[0].rm_eo = -1;
+	/* Lines keep their newline, REG_NEWLINE lets '$' match in front of it */
+	re_compile(re, exp, REG_NEWLINE | (opt_extended ? REG_EXTENDED : 0) | 
+		(re->icase ? REG_ICASE : 0));
+}
+
+void re_save(re_t *re) {
+	ses_put_str(re->pattern);
+	ses_put_u64(re->cflags);
+	ses_put_u64(re->icase);
+	ses_put_str(re->subst == NULL ? NULL : ds_get_s(re->subst));
+	ses_put_u64(re->global);
+	ses_put_u64(re->print);
+	ses_put_u64(re->number);
+	ses_put_u64(re->N);
+}
+
+void re_load(re_t *re) {
+	char *pattern = ses_get_str();
+	int cflags = ses_get_u64();
+	re->icase = ses_get_u64();
+	if (pattern != NULL) {
+		re_compile(re, pattern, cflags);
+		free(pattern);
+	}
+	char *subst = ses_get_str();
+	if (subst != NULL) {
+		re_set_subst(re, subst);
+		free(subst);
 	}
+	re->global = ses_get_u64();
+	re->print = ses_get_u64();
+	re->number = ses_get_u64();
+	re->N = ses_get_u64();
+}
 
-	if (re->subst == NULL) {
-		re->subst = ds_make();
+void re_set_icase(re_t *re, _Bool icase) {
+	if (re->icase == icase) {
+		return;
+	}
+	re->icase = icase;
+	if (re->pattern != NULL) {
+		char *pattern = strdup(re->pattern);
+		parse_regex(re, pattern);
+		free(pattern);
 	}
+}
 
-	ds_clear(re->subst);
+void re_copy(re_t *dst, re_t *src) {
+	dst->icase = src->icase;
+	if (src->pattern != NULL) {
+		re_compile(dst, src->pattern, src->cflags);
+	}
+	if (src->subst != NULL) {
+		re_set_subst(dst, ds_get_s(src->subst));
+	}
+	dst->global = src->global;
+	dst->print = src->print;
+	dst->number = src->number;
+	dst->N = src->N;
+}
+
+int re_clone(re_t *re, regex_t *reg) {
+	return regcomp(reg, re->pattern, re->cflags);
+}
+
+/* 
+ * Expand the substitution template 'exp' for the first match of 're' (run
+ * with 'reg') in 'line' into 'out'. Match offsets are left in 'pm'.
+ */
+static void subst_expand(re_t *re, regex_t *reg, regmatch_t *pm, ds_t *out, 
+		char *line, char *exp, int eflags) {
+	if (re->fixed != NULL) {
+		/* A fixed pattern has no subexpressions, only the whole match */
+		pm[0].rm_so = fixed_match(re, line, strlen(line), eflags);
+		pm[0].rm_eo = (pm[0].rm_so == -1 ? -1 : pm[0].rm_so + (regoff_t)re->fixed_len);
+		pm[1].rm_so = pm[1].rm_eo = -1;
+	}
+	else if (regexec(reg, line, NMATCH, pm, eflags) != 0) { 
+		pm[0].rm_so = -1;
+		pm[0].rm_eo = -1;
+	}
+
+	ds_clear(out);
 	while (*exp) {
 		if (*exp == '&' && *(exp-1) != '\\') {
-			ds_cat_e(re->subst, line + pmatch[0].rm_so, line + pmatch[0].rm_eo - 1);
+			ds_cat_e(out, line + pm[0].rm_so, line + pm[0].rm_eo - 1);
 		}
 		else if (isdigit(*exp) && *(exp-1) == '\\') {
-			ds_cat_e(re->subst, line + pmatch[*exp - '0'].rm_so, line + pmatch[*exp - '0'].rm_eo -1);
+			ds_cat_e(out, line + pm[*exp - '0'].rm_so, line + pm[*exp - '0'].rm_eo -1);
 		}
 		else if (*exp == '\\') {
 		}
 		else {
-			ds_append(re->subst, *exp);
+			ds_append(out, *exp);
 		}
 		exp++;
 	}
 }
 
+void parse_subst(re_t *re, char *line, char *exp) {
+	if (re->subst == NULL) {
+		re->subst = ds_make();
+	}
+	if (exp == NULL) {
+		exp = ds_get_s(re->subst);
+	}
+	subst_expand(re, &re->re, pmatch, re->subst, line, exp, 0);
+}
+
 void parse_tail(re_t *re, char *tail) {
-	/* N, r, p, g */
+	/* N, r, p, g; a new substitution starts from none of them */
+	re->number = 0;
+	re->N = 0;
+	re->global = 0;
+	re->print = 0;
 	if (tail == NULL || *tail == '\0') {
 		return;
 	}
-	if (*tail == '\n') {
-		re->number = 1;
-		re->N = 1;
-	}
 
 	for (; *tail; tail++) {
 		if (isdigit(*tail)) {
@@ -308,14 +725,11 @@ void parse_tail(re_t *re, char *tail) {
 	}
 }
 
+/* The suffixes of a bare s, which toggle those of the last substitution */
 void parse_tail_alt(re_t *re, char *tail) {
 	if (tail == NULL || *tail == '\0') {
 		return;
 	}
-	if (*tail == '\n') {
-		re->number = 1;
-		re->N = 1;
-	}
 	for (; *tail; tail++) {
 		if (isdigit(*tail)) {
 			re->N = strtol(tail, &tail, 10);
@@ -331,7 +745,9 @@ void parse_tail_alt(re_t *re, char *tail) {
 					toggle(re->print);
 					break;
 				case 'g':
+					/* Like ed, g also drops the count */
 					toggle(re->global);
+					re->number = 0;
 					break;
 			}
 		}
@@ -352,58 +768,194 @@ char *next_unescaped_delimiter(char *exp, char delimiter) {
 	return exp;	
 }
 
-char *re_replace(re_t *re, char *line, char *subst) {
+int re_match(re_t *re, char *line, size_t len) {
+	return re_match_r(re, &re->re, line, len);
+}
+
+int re_match_r(re_t *re, regex_t *reg, char *line, size_t len) {
+	if (line == NULL) {
+		return 0;
+	}
+	if (re->fixed != NULL) {
+		return fixed_match(re, line, len, 0) != -1;
+	}
+	if (re->literal != NULL && 
+			lit_find(line, re->literal, strlen(re->literal), re->icase) == NULL) {
+		return 0;
+	}
+	return regexec(reg, line, 0, NULL, 0) == 0;
+}
+
+size_t re_count_r(re_t *re, regex_t *reg, char *line, size_t len) {
+	if (!re_match_r(re, reg, line, len)) {
+		return 0;
+	}
+	regmatch_t pm[1];
+	size_t count = 0;
+	int eflags = 0;
+	char *p = line;
+	while (*p) {
+		if (re->fixed != NULL) {
+			pm[0].rm_so = fixed_match(re, p, len - (p - line), eflags);
+			pm[0].rm_eo = pm[0].rm_so + re->fixed_len;
+		}
+		else if (regexec(reg, p, 1, pm, eflags) != 0) {
+			break;
+		}
+		if (pm[0].rm_so == -1) {
+			break;
+		}
+		count++;
+		p += pm[0].rm_eo;
+		/* An empty match would be found again at the same place */
+		if (pm[0].rm_so == pm[0].rm_eo) {
+			if (*p == '\0') {
+				break;
+			}
+			p++;
+		}
+		eflags = REG_NOTBOL;
+	}
+	return count;
+}
+
+/*
+ * The work horse of re_replace() and re_replace_r(). All the state it 
+ * touches is passed in, so any number of threads may run it on different 
+ * lines as long as each brings its own 'reg', 'pm' and 'buf'. The line is
+ * 'len' bytes, the size of the result goes in 'size'. Matches are only 
+ * looked for up to a NUL in the line, the bytes after it are kept. Return
+ * NULL if memory ran out; nothing here raises an error.
+ */
+static char *replace_aux(re_t *re, regex_t *reg, regmatch_t *pm, ds_t *buf,
+		char *line, size_t len, char *subst, size_t *size) {
 	ds_t ds;
 	ds.s = NULL;
 	ds.sz = 0;
 	ds.nmemb = 0;
+	ds.failed = 0;
+	buf->failed = 0;
 
 	_Bool number = re->number;
 	int num = re->N;
 	// line is a line is a line
 	
-	parse_subst(re, line, subst);
+	subst_expand(re, reg, pm, buf, line, subst, 0);
 	if (number) {
 		num--;
 	}
 	char *i = line;
-	while (*i) {
-		if (i == line + pmatch[0].rm_so) {
-			if (number && num > 0) {
-				ds_cat_e(&ds, line + pmatch[0].rm_so, line + pmatch[0].rm_eo - 1);
-				i = line + pmatch[0].rm_eo;
-				line = i;
-				parse_subst(re, i, subst);
-				num--;
+	char *end = line + len;
+	_Bool empty;
+	/* The last match was not empty and ended at 'i' */
+	_Bool after_match = 0;
+	while (i < end) {
+		if (pm[0].rm_so == -1 || i != line + pm[0].rm_so) {
+			if (*i == '\\') {
+				++i;
 			}
 			else {
-				char *s = ds_get_s(re->subst);
-				int sz = re->subst->nmemb;
-				ds_cat_e(&ds, s, s + sz -1);
-				i = line + pmatch[0].rm_eo;
-				line = i;
-				if (re->global) {
-					parse_subst(re, i, subst);
-				}
-				if (number && num <= 0) {
-					line += strlen(i);
-				}
+				ds_append(&ds, *i);
+				i++;
 			}
+			continue;
+		}
+		empty = (pm[0].rm_so == pm[0].rm_eo);
+		if (empty && after_match) {
+			/* Like ed, an empty match right behind a match doesn't count */
+			ds_append(&ds, *i++);
+			line = i;
+			after_match = 0;
+			subst_expand(re, reg, pm, buf, i, subst, REG_NOTBOL);
+			continue;
 		}
-		else if (*i == '\\') {
-			++i;
+		_Bool more = 1;
+		if (number && num > 0) {
+			ds_cat_e(&ds, line + pm[0].rm_so, line + pm[0].rm_eo - 1);
+			num--;
 		}
 		else {
-			ds_append(&ds, *i);
-			i++;
+			char *s = ds_get_s(buf);
+			int sz = buf->nmemb;
+			ds_cat_e(&ds, s, s + sz -1);
+			more = (!number && re->global);
+		}
+		i = line + pm[0].rm_eo;
+		after_match = !empty;
+		if (empty && i < end) {
+			/* Step over an empty match, it would only match again */
+			ds_append(&ds, *i++);
+		}
+		line = i;
+		if (more) {
+			subst_expand(re, reg, pm, buf, i, subst, REG_NOTBOL);
+		}
+		else {
+			/* Done with the line, copy the rest */
+			pm[0].rm_so = pm[0].rm_eo = -1;
 		}
 	}
-	if (re->print) {
-		io_write_line(stdout, "%s", ds.s);
+	/* An empty result is still a string, NULL only means failure */
+	ds_cat_n(&ds, "", 0);
+	if (ds.failed || buf->failed) {
+		free(ds.s);
+		return NULL;
 	}
+	*size = ds.nmemb;
 	return ds.s;
 }
 
+char *re_replace(re_t *re, char *line, size_t len, char *subst, size_t *size) {
+	if (re->subst == NULL) {
+		re->subst = ds_make();
+	}
+	if (subst == NULL) {
+		subst = ds_get_s(re->subst);
+	}
+	char *s = replace_aux(re, &re->re, pmatch, re->subst, line, len, subst, 
+			size);
+	if (s == NULL) {
+		err(&to_repl, strerror(ENOMEM));
+	}
+	if (re->print) {
+		io_write_buf(stdout, s, *size);
+	}
+	return s;
+}
+
+char *re_replace_r(re_t *re, regex_t *reg, char *line, size_t len, 
+		char *subst, size_t *size) {
+	regmatch_t pm[NMATCH];
+	ds_t buf;
+	buf.s = NULL;
+	buf.sz = 0;
+	buf.nmemb = 0;
+	buf.failed = 0;
+	char *s = replace_aux(re, reg, pm, &buf, line, len, subst, size);
+	ds_free(&buf);
+	return s;
+}
+
+int re_print(re_t *re) {
+	return re->print;
+}
+
+int re_compiled(re_t *re) {
+	return re->pattern != NULL;
+}
+
+char *re_literal(re_t *re) {
+	/* The search filters only know the case the lines were written in */
+	if (re->icase) {
+		return NULL;
+	}
+	return re->literal;
+}
+
+regex_t *re_regex(re_t *re) {
+	return &re->re;
+}
+
 /* Command list:
  * EG:
  * 		a\
@@ -423,18 +975,19 @@ void yb_print(yb_t *yb) {
 	printf("\n");
 }
 
-/* Load the regex in 'exp' in 'reg'; return the start of command-list */
-char *parse_global_command(regex_t *reg, char *exp) {
+/* Load the regex in 'exp' in 're'; return the start of command-list */
+char *parse_global_command(re_t *re, char *exp) {
 	char delimiter = *exp++;
 	char *regex = exp;
 	exp = next_unescaped_delimiter(regex, delimiter);
-	exp = skipspaces(exp);
-
-	int err;
-	if ((err = regcomp(reg, regex, (opt_extended ? REG_EXTENDED : 0))) != 0) {
-		err(&to_repl, regerror_aux(err, reg));
+	re_set_icase(re, exp != NULL && *exp == 'I');
+	parse_regex(re, regex);
+	if (exp != NULL) {
+		/* Put the delimiter back, a command list may run this again */
+		exp[-1] = delimiter;
+		exp += (*exp == 'I');
 	}
-	return exp;
+	return skipspaces(exp);
 }
 
 void read_command_list(yb_t *yb, char *cmd) {
@@ -472,58 +1025,158 @@ void read_command_list(yb_t *yb, char *cmd) {
 	free(line);
 }
 
-void execute_command_list(yb_t *yb, node_t *from) {
-	char current_cmd = 'p'; /* default command */
+/* 
+ * Command lists are decoded once, by compile_command_list(), into an array
+ * of ops that execute_command_list() runs for every matching line without
+ * parsing or allocating anything.
+ */
+
+typedef struct op_t {
+	char cmd;
+	/* Argument of the command, as eval_command() wants it */
+	char *arg;
+	/* a, i, c: the text is yb[text] up to, but not including, yb[text + ntext] */
+	int text;
+	int ntext;
+	/* s: compiled regex and template, a bare s gets a copy of the last one */
+	re_t *re;
+	char *subst;
+	/* s: private copy of the argument, subs_compile() cuts it up */
+	char *copy;
+} op_t;
+
+typedef struct ol_t {
+	op_t *ops;
+	size_t sz;
+	size_t nmemb;
+	yb_t *yb;
+} ol_t;
+
+ol_t *ol_make() {
+	ol_t *ol = calloc(1, sizeof(*ol));
+	ol->ops = NULL;
+	ol->sz = 0;
+	ol->nmemb = 0;
+	ol->yb = NULL;
+	return ol;
+}
+
+static void ol_clear(ol_t *ol) {
+	for (size_t i = 0; i < ol->nmemb; ++i) {
+		if (ol->ops[i].re != NULL) {
+			re_free(ol->ops[i].re);
+			free(ol->ops[i].re);
+		}
+		free(ol->ops[i].copy);
+	}
+	ol->nmemb = 0;
+}
+
+void ol_free(ol_t *ol) {
+	ol_clear(ol);
+	free(ol->ops);
+}
+
+static op_t *ol_push(ol_t *ol, char cmd, char *arg) {
+	size_t sz = (ol->sz == 0 ? 1 : ol->sz);
+	if (ol->sz == ol->nmemb) {
+		ol->ops = realloc(ol->ops, (sz * 2) * sizeof(*(ol->ops)));
+		ol->sz = sz * 2;
+	}
+	op_t *op = &ol->ops[ol->nmemb++];
+	op->cmd = cmd;
+	op->arg = arg;
+	op->text = 0;
+	op->ntext = 0;
+	op->re = NULL;
+	op->subst = NULL;
+	op->copy = NULL;
+	return op;
+}
+
+/*
+ * Each s of the list gets its own regex; a bare s copies the one of the s 
+ * before it, in the list or before the list. The last one becomes the last
+ * substitution, for the commands after the global command.
+ */
+void compile_command_list(ol_t *ol, yb_t *yb) {
 	char *cmd;
+	op_t *op;
+	re_t *last = subs_last();
+	ol_clear(ol);
+	ol->yb = yb;
 
 	for (int i = 0; i < (int)yb->nmemb; ++i) {
 		cmd = skipspaces(yb_at(yb, i));
-		current_cmd = *cmd;
-		if (current_cmd == 'g' || current_cmd == 'G' || current_cmd == 'v' ||
-				current_cmd == 'V') {
-			err_normal(&to_repl, "Illegal command %c in the command-list\n", current_cmd);
+		if (*cmd == 'g' || *cmd == 'G' || *cmd == 'v' || *cmd == 'V') {
+			err_normal(&to_repl, "Illegal command %c in the command-list\n", *cmd);
 		}
 		else if (*cmd == 'a' || *cmd == 'i' || *cmd == 'c') {
-			cmd = skipspaces(++cmd);
-			if (isalnum(*cmd)) {
+			op = ol_push(ol, *cmd, skipspaces(cmd + 1));
+			if (isalnum(*op->arg)) {
 				err_normal(&to_repl, "%s\n", "Invalid command suffix");
 			}
-			else {
-				if (current_cmd == 'i') {
-					push_to_undo_buf('i');
-					from = ll_prev(from, 1);
-				}
-				else if (current_cmd == 'c') {
-					push_to_undo_buf('c');
-					from = ll_remove_shallow(from);
-					push_to_delete_buf(&brake);
-					push_to_delete_buf(from);
-					from = ll_prev(from, 1);
-				}
-				else if (current_cmd == 'a') {
-					push_to_undo_buf('a');
-				}
-
-				push_to_append_buf(&brake);
-				for (i += 1; i < (int)yb->nmemb; ++i) {
-					if (yb_at(yb, i)[0] == '.') {
-						break;
-					}
-					push_to_append_buf(ll_add_next(from, yb_at(yb, i)));
-					from = ll_next(from, 1);
+			op->text = i + 1;
+			for (i += 1; i < (int)yb->nmemb; ++i) {
+				if (yb_at(yb, i)[0] == '.') {
+					break;
 				}
 			}
+			op->ntext = i - op->text;
+		}
+		else if (*cmd == 's') {
+			op = ol_push(ol, *cmd, skipspaces(cmd + 1));
+			char c = *op->arg;
+			op->copy = strdup(op->arg);
+			op->re = re_make();
+			if (c == '\n' || isdigit(c) || c == 'r' || c == 'g' || c == 'p') {
+				re_copy(op->re, last);
+			}
+			op->subst = subs_compile(op->re, op->copy);
+			last = op->re;
 		}
 		else if (strchr(gbl_commands, *cmd) != NULL) {
-			parse_t *pt = pt_make();
-			cmd++;
-			pt_set(pt, from, from, current_cmd, skipspaces(cmd));
-			parse_defaults = 0;
-			eval(pt);
-			free(pt);
+			ol_push(ol, *cmd, skipspaces(cmd + 1));
 		}
 		else {
 			err_normal(&to_repl, "%s\n", "Invalid Command");
 		}
 	}
+	if (last != subs_last()) {
+		re_copy(subs_last(), last);
+	}
+}
+
+_Bool ol_runs(ol_t *ol, char cmd) {
+	for (size_t i = 0; i < ol->nmemb; ++i) {
+		if (ol->ops[i].cmd == cmd) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+_Bool execute_command_list(ol_t *ol, node_t *from) {
+	op_t *op;
+	yb_t *yb = ol->yb;
+	_Bool changed = 0;
+
+	for (size_t i = 0; i < ol->nmemb; ++i) {
+		op = &ol->ops[i];
+		if (op->cmd == 'a' || op->cmd == 'i' || op->cmd == 'c') {
+			from = list_text(op->cmd, from, yb, op->text, op->ntext);
+		}
+		else {
+			if (op->cmd == 's') {
+				changed = subs_line(op->re, from, op->subst) || changed;
+			}
+			else {
+				parse_defaults = 0;
+				eval_command(from, from, op->cmd, op->arg);
+			}
+			/* The next command works on whatever this one left as '.' */
+			from = global_current();
+		}
+	}
+	return changed;
 }
@@ -24,6 +24,8 @@ char *regerror_aux(int errcode, regex_t *reg);
 typedef struct ds_t ds_t;
 ds_t *ds_make();
 void ds_append(ds_t *ds, char c);
+/* Append the 'n' bytes at 's' */
+void ds_cat_n(ds_t *ds, char *s, size_t n);
 void ds_set(ds_t *obj, char *s);
 char *ds_get_s(ds_t *obj);
 size_t ds_get_sz(ds_t *obj);
@@ -32,6 +34,8 @@ char ds_pop(ds_t *ds);
 char ds_false_push(ds_t *ds);
 int ds_nmembs(ds_t *ds);
 void ds_clear(ds_t *ds);
+/* Did growing 'ds' ever fail; ds_append() and ds_cat_n() drop what won't fit */
+_Bool ds_failed(ds_t *ds);
 
 typedef struct yb_t yb_t;
 void yb_append(yb_t *yb, char *s);
@@ -49,9 +53,47 @@ re_t *re_make();
 void re_free(re_t *re);
 ds_t *re_get_subst(re_t *re);
 int re_has_subst(re_t *re);
+/* Remember 'subst' as the template for substitutions without arguments */
+void re_set_subst(re_t *re, char *subst);
+/* Make 'dst' hold the regex, template and flags of 'src' */
+void re_copy(re_t *dst, re_t *src);
+/* Compile a private copy of 're' into 'reg', for use by another thread */
+int re_clone(re_t *re, regex_t *reg);
+/* Should substituted lines be printed (the 'p' suffix) */
+int re_print(re_t *re);
+/* 
+ * Make 're' ignore case (the 'I' flag) or not, recompiling it if it holds
+ * a regex already
+ */
+void re_set_icase(re_t *re, _Bool icase);
+/* Has a regex been compiled into 're' yet */
+int re_compiled(re_t *re);
+/* A string all matches of 're' contain, or NULL */
+char *re_literal(re_t *re);
+/* The compiled regex of 're', for the calling thread only */
+regex_t *re_regex(re_t *re);
+/* Write 're' to the session image being saved, or read it back, see ses.h */
+void re_save(re_t *re);
+void re_load(re_t *re);
 
 char *next_unescaped_delimiter(char *exp, char delimiter);
-char *re_replace(re_t *re, char *line, char *subst);
+/* 
+ * Substitute 'subst' for the matches of 're' in 'line', 'len' bytes long. 
+ * Returns a malloc'd string and sets 'size' to its size.
+ */
+char *re_replace(re_t *re, char *line, size_t len, char *subst, size_t *size);
+/* 
+ * Reentrant re_replace(): matches with 'reg' (see re_clone()), uses no global
+ * state and does not print. 
+ */
+char *re_replace_r(re_t *re, regex_t *reg, char *line, size_t len, 
+		char *subst, size_t *size);
+/* Does 'line', 'len' bytes long, match the regex in 're' */
+int re_match(re_t *re, char *line, size_t len);
+/* re_match() with 'reg' (see re_clone()) instead of the regex of 're' */
+int re_match_r(re_t *re, regex_t *reg, char *line, size_t len);
+/* The number of matches of 're' (run with 'reg') in 'line', 'len' bytes long */
+size_t re_count_r(re_t *re, regex_t *reg, char *line, size_t len);
 char *next_unescaped_delimiter(char *exp, char delimiter);
 void parse_tail(re_t *re, char *tail);
 void parse_tail_alt(re_t *re, char *tail);
@@ -59,8 +101,18 @@ void parse_subst(re_t *re, char *line, char *exp);
 void parse_regex(re_t *re, char *exp);
 char *strsubs(re_t *re, char *line, char *exp);
 
-char *parse_global_command(regex_t *reg, char *exp);
+char *parse_global_command(re_t *re, char *exp);
 
 void read_command_list(yb_t *yb, char *cmd);
-void execute_command_list(yb_t *yb, node_t *from);
+
+/* A command list decoded into ops, see compile_command_list() */
+typedef struct ol_t ol_t;
+ol_t *ol_make();
+void ol_free(ol_t *ol);
+/* Decode the command list in 'yb'; 'ol' refers to 'yb' until the next call */
+void compile_command_list(ol_t *ol, yb_t *yb);
+/* Run 'ol' on 'from', return 1 if any of its s commands changed a line */
+_Bool execute_command_list(ol_t *ol, node_t *from);
+/* Does 'ol' have a 'cmd' command */
+_Bool ol_runs(ol_t *ol, char cmd);
 #endif
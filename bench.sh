@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Wall times of a few global commands on large generated files. Run with
+# "make bench", or as ./bench.sh [path to edd]. Files go in a temporary directory that is
+# removed afterwards. Times are in seconds and depend on the machine;
+# compare runs of two builds on the same one.
+
+set -e
+EDD=${1:-./edd}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+TIMEFORMAT=%R
+
+# Run the commands $2 on a copy of the file $1, print the time it took
+run() {
+	cp "$1" "$dir/work"
+	{ time printf "$2" | "$EDD" "$dir/work" >/dev/null 2>&1; } 2>&1
+}
+
+report() {
+	printf '%-44s %s\n' "$1" "$2"
+}
+
+# 1M lines that all match, g runs its command list on every one of them
+seq 1000000 | sed 's/^/xa /' > "$dir/1m"
+report "g/x/s/a/b/ then p, 1M lines" "$(run "$dir/1m" 'g/x/s/a/b/\\\np\nw\nq\n')"
+
+# 2M lines, 1M of them match. u + U is the run with five u and U pairs
+# minus the run without them, divided by five
+seq 2000000 | sed 's/$/ foo bar baz/' > "$dir/2m"
+undo_redo() {
+	local without=$(run "$dir/2m" "$1\nQ\n")
+	local with=$(run "$dir/2m" "$1\nu\nU\nu\nU\nu\nU\nu\nU\nu\nU\nQ\n")
+	awk "BEGIN { printf \"%.3f\\n\", ($with - $without) / 5 }"
+}
+report "g/[02468] foo/m0, u+U, 2M lines" "$(undo_redo 'g/[02468] foo/m0')"
+report "g/[02468] foo/s/bar/X/\\ s/baz/Y/, u+U" \
+	"$(undo_redo 'g/[02468] foo/s/bar/X/\\\ns/baz/Y/')"
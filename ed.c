@@ -10,6 +10,9 @@
 #include "io.h"
 #include "err.h"
 #include "undo.h"
+#include "par.h"
+#include "rec.h"
+#include "ses.h"
 
 #define ED_PROMPT_SIZE 64
 static char gbl_prompt[ED_PROMPT_SIZE];
@@ -18,6 +21,17 @@ static char gbl_prompt[ED_PROMPT_SIZE];
 static char gbl_default_filename[ED_DEFAULT_FILENAME_SIZE];
 
 static _Bool gbl_saved = 1;
+/* The undo_version() last written, undo and redo can bring it back */
+static size_t gbl_saved_version = 0;
+
+static void set_saved() {
+	gbl_saved = 1;
+	gbl_saved_version = undo_version();
+}
+
+static _Bool modified() {
+	return !gbl_saved && undo_version() != gbl_saved_version;
+}
 
 void set_prompt(char *s) {
 	size_t sz = strlen(s);
@@ -47,6 +61,7 @@ void set_default_filename(char *s) {
 	if (gbl_default_filename[size - 1] == '\n') {
 		gbl_default_filename[size - 1] = '\0';
 	}
+	rec_filename(gbl_default_filename);
 }
 
 char *get_default_filename() {
@@ -57,10 +72,31 @@ char *get_default_filename() {
 }
 
 
+/*
+ * A yank register holds detached nodes that share the text of the lines
+ * yanked, linked from 'first' to 'last', see ll_chain_shared().
+ */
+typedef struct reg_t {
+	node_t *first;
+	node_t *last;
+	size_t lines;
+	size_t bytes;
+} reg_t;
+
+/* The registers 'a' to 'z', and the unnamed one y and x use by default */
+#define UNNAMED_REG 0
+#define REG_LIM ('z' - 'a' + 2)
+
 static ds_t *gbl_command_buf;
-static yb_t *gbl_yank_buf;
+static reg_t gbl_regs[REG_LIM];
 static re_t *gbl_re;
 static yb_t *gbl_global_cmd_buf;
+static re_t *gbl_global_re;
+static re_t *gbl_count_re;
+static ol_t *gbl_global_ops;
+/* Lines marked by the last global command, see global_mark() */
+static node_t **gbl_marked;
+static size_t gbl_marked_sz;
 
 void set_command_buf(char *cmd) {
 	if (cmd == ds_get_s(gbl_command_buf)) {
@@ -79,46 +115,82 @@ char *get_command_buf() {
 	return ds_get_s(gbl_command_buf);
 }
 
+static void reg_clear(reg_t *reg) {
+	node_t *next;
+	for (node_t *node = reg->first; node != NULL; node = next) {
+		next = ll_next(node, 1);
+		ll_free_node(node);
+	}
+	reg->first = reg->last = NULL;
+	reg->lines = reg->bytes = 0;
+}
+
+static void reg_push(reg_t *reg, node_t *node) {
+	reg->last = ll_chain_shared(reg->last, node);
+	reg->first = (reg->first == NULL ? reg->last : reg->first);
+	reg->lines++;
+	reg->bytes += ll_node_size(node);
+}
+
+/* 
+ * The register named in 'rest', the argument of y or x: a letter, or 
+ * nothing for the unnamed one. An upper case letter sets 'append'.
+ */
+static reg_t *reg_of(char *rest, _Bool *append) {
+	int c = (unsigned char)*skipspaces(rest);
+	*append = 0;
+	if (c == '\0' || c == '\n') {
+		return &gbl_regs[UNNAMED_REG];
+	}
+	if (tolower(c) < 'a' || tolower(c) > 'z') {
+		err_normal(&to_repl, "Invalid register: %c. Registers are the "
+				"letters a to z, A to Z appends to them\n", c);
+	}
+	*append = isupper(c);
+	return &gbl_regs[tolower(c) - 'a' + 1];
+}
+
 void gbl_buffers_init() {
 	atexit(gbl_buffers_free);
 	gbl_command_buf = ds_make();
-	gbl_yank_buf = yb_make();
 	gbl_re = re_make();
 	gbl_global_cmd_buf = yb_make();
+	gbl_global_re = re_make();
+	gbl_count_re = re_make();
+	gbl_global_ops = ol_make();
 }
 
 void gbl_buffers_free() {
 	ds_free(gbl_command_buf);
 	free(gbl_command_buf);
 
-	yb_free(gbl_yank_buf);
-	free(gbl_yank_buf);
+	for (int i = 0; i < REG_LIM; ++i) {
+		reg_clear(&gbl_regs[i]);
+	}
 
 	re_free(gbl_re);
 	free(gbl_re);
 
 	yb_free(gbl_global_cmd_buf);
 	free(gbl_global_cmd_buf);
-}
 
-/* Yank Buffer Functions */
-void yank_buf_push(char *s) {
-	yb_append(gbl_yank_buf, s);
-}
+	re_free(gbl_global_re);
+	free(gbl_global_re);
 
-char *yank_buf_get(int at) {
-	return yb_at(gbl_yank_buf, at);
-}
+	re_free(gbl_count_re);
+	free(gbl_count_re);
+
+	ol_free(gbl_global_ops);
+	free(gbl_global_ops);
 
-void yank_buf_clear() {
-	yb_clear(gbl_yank_buf);
+	free(gbl_marked);
 }
 
 /* Mark functions */
 
 #define FIRST_MARK '!'
 #define LAST_MARK '~'
-#define MARK_LIM (LAST_MARK - FIRST_MARK)
+#define MARK_LIM (LAST_MARK - FIRST_MARK + 1)
 node_t *gbl_marks[MARK_LIM];
 
 int set_mark(node_t *node, int at) {
@@ -137,37 +209,189 @@ node_t *get_mark(int at) {
 	if (at < FIRST_MARK || at > LAST_MARK) {
 		err_normal(&to_repl, "Invalid Mark: %c", at);
 	}
-	return gbl_marks[at - FIRST_MARK];
+	/* 
+	 * A line a delete or an undo took out has no mark until it is back. 
+	 * Lines inside a run taken out still link to each other, so only a walk
+	 * of the list tells, as parse_address() makes anyway.
+	 */
+	node_t *mark = gbl_marks[at - FIRST_MARK];
+	for (node_t *node = global_head(); mark != NULL && node != global_tail();
+			node = ll_next(node, 1)) {
+		if (node == mark) {
+			return mark;
+		}
+	}
+	return NULL;
 }
 
 void clear_mark(int at) {
 	gbl_marks[at - FIRST_MARK] = NULL;
 }
 
+void clear_marks_at(node_t *node) {
+	for (int i = 0; i < MARK_LIM; ++i) {
+		if (gbl_marks[i] == node) {
+			gbl_marks[i] = NULL;
+		}
+	}
+}
+
+/* The marks on 'node' go to 'to', which replaces it */
+static void move_marks(node_t *node, node_t *to) {
+	for (int i = 0; i < MARK_LIM; ++i) {
+		if (gbl_marks[i] == node) {
+			gbl_marks[i] = to;
+		}
+	}
+}
+
+/* Session images, see ses.h */
+
+void buffers_save() {
+	ses_put_str(get_default_filename());
+	ses_put_str(ds_get_s(gbl_command_buf));
+	ses_put_u64(gbl_saved);
+	ses_put_u64(gbl_saved_version);
+	for (int i = 0; i < REG_LIM; ++i) {
+		ses_put_u64(gbl_regs[i].lines);
+		for (node_t *node = gbl_regs[i].first; node != NULL; 
+				node = ll_next(node, 1)) {
+			ses_put_text(ll_s(node), ll_node_size(node));
+		}
+	}
+	re_save(gbl_re);
+	for (int i = 0; i < MARK_LIM; ++i) {
+		ses_put_node(gbl_marks[i]);
+	}
+}
+
+void buffers_load() {
+	char *s;
+	if ((s = ses_get_str()) != NULL) {
+		set_default_filename(s);
+		free(s);
+	}
+	if ((s = ses_get_str()) != NULL) {
+		set_command_buf(s);
+		free(s);
+	}
+	gbl_saved = ses_get_u64();
+	gbl_saved_version = ses_get_u64();
+	node_t *node;
+	size_t size;
+	for (int i = 0; i < REG_LIM; ++i) {
+		reg_clear(&gbl_regs[i]);
+		for (size_t j = ses_get_u64(); j > 0; --j) {
+			s = ses_get_text(&size);
+			node = ll_make_shallow(ll_text_adopt(s, size), size);
+			reg_push(&gbl_regs[i], node);
+			ll_free_node(node);
+		}
+	}
+	re_load(gbl_re);
+	for (int i = 0; i < MARK_LIM; ++i) {
+		gbl_marks[i] = ses_get_node();
+	}
+}
 
 /* ed_ functions */
 
+/*
+ * Edits that take lines out of the list or put new ones in work on whole 
+ * runs, see ll_splice_after(), and record them in the range log under a 'D'
+ * undo record: a run costs the same few link updates however long it is.
+ */
+
+/* Start a 'D' undo record */
+static void range_record() {
+	if (push_to_undo_buf('D')) {
+		push_to_range_log(NULL, NULL, 0, 0, 0);
+	}
+}
+
+/* Put the run first..last, built with ll_chain(), after 'at' */
+static void insert_range(node_t *at, node_t *first, node_t *last, 
+		size_t lines, size_t bytes) {
+	if (lines == 0) {
+		return;
+	}
+	ll_splice_after(at, first, last, lines);
+	push_to_range_log(first, last, lines, bytes, 1);
+}
+
+/* Take the lines from..to out of the list, return how many there were */
+static size_t delete_range(node_t *from, node_t *to) {
+	size_t lines = 0;
+	size_t bytes = 0;
+	for (node_t *node = from; ; node = ll_next(node, 1)) {
+		/* Leaving the list, see ll_set_mark() */
+		ll_set_mark(node, 0);
+		lines++;
+		bytes += ll_node_size(node);
+		if (node == to) {
+			break;
+		}
+	}
+	ll_detach_range(from, to, lines);
+	push_to_range_log(from, to, lines, bytes, 0);
+	return lines;
+}
+
+node_t *list_text(char cmd, node_t *node, yb_t *yb, int text, int ntext) {
+	range_record();
+	node_t *at = (cmd == 'a' ? node : ll_prev(node, 1));
+	if (cmd == 'c') {
+		delete_range(node, node);
+	}
+	size_t bytes = 0;
+	node_t *first = NULL;
+	node_t *last = NULL;
+	char *s;
+	for (int t = text; t < text + ntext; ++t) {
+		s = yb_at(yb, t);
+		last = ll_chain(last, s, strlen(s));
+		first = (first == NULL ? last : first);
+		bytes += ll_node_size(last);
+	}
+	insert_range(at, first, last, ntext, bytes);
+	return (last == NULL ? at : last);
+}
+
+/* Resolve the range of d and c, NULL if the buffer is empty */
+static node_t *delete_bounds(node_t **from, node_t **to) {
+	*from = (*from == global_tail() ? ll_last_node() : *from);
+	*from = (*from == global_head() ? ll_first_node() : *from);
+	*to = (*to == global_tail() ? ll_last_node() : *to);
+	if (ll_len() == 0) {
+		return NULL;
+	}
+	return *from;
+}
+
 static size_t append_aux(node_t *from) {
 	char *line = NULL;
+	ssize_t n;
 	size_t bytes = 0;
 	size_t lines = 0;
 	size_t linecap;
-	push_to_append_buf(&brake);
-	while ((bytes = io_read_line(&line, &linecap, stdin, NULL)) > 0) {
+	node_t *first = NULL;
+	node_t *last = NULL;
+	while ((n = io_read_line(&line, &linecap, stdin, NULL)) > 0) {
 		if (line[0] == '.')
 			break;
-		from = ll_add_next(from, line);
-		push_to_append_buf(from);
+		last = ll_chain(last, line, n);
+		first = (first == NULL ? last : first);
 		lines++;
-		bytes += bytes;
+		bytes += n;
 	}
 	free(line);
+	insert_range(from, first, last, lines, bytes);
 	return lines;
 }
 
 
 void ed_append(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('a');
+	range_record();
 	from = (from == global_tail() ? ll_last_node() : from);
 	size_t lines = append_aux(from);
 	io_write_line(stdout, "%ld line%s appended\n", lines, (lines==1)?"":"s");
@@ -175,7 +399,7 @@ void ed_append(node_t *from, node_t *to, char *rest) {
 }
 
 void ed_insert(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('i');
+	range_record();
 	from = (from == global_tail() ? ll_last_node() : from);
 	from = (from == global_head() ? from : ll_prev(from, 1));
 	size_t lines = append_aux(from);
@@ -188,7 +412,8 @@ void ed_print(node_t *from, node_t *to, char *rest) {
 		return;
 	}
 	if (parse_defaults) {
-		io_write_line(stdout, "%s", ll_s(global_current()));
+		io_write_buf(stdout, ll_s(global_current()), 
+				ll_node_size(global_current()));
 		return;
 	}
 
@@ -196,7 +421,7 @@ void ed_print(node_t *from, node_t *to, char *rest) {
 	from = (from == global_tail() ? ll_prev(from, 1) : from);
 
 	while (from != to) {
-		io_write_line(stdout, "%s", ll_s(from));
+		io_write_buf(stdout, ll_s(from), ll_node_size(from));
 		from = ll_next(from, 1);
 	}
 }
@@ -210,48 +435,42 @@ void ed_print_n(node_t *from, node_t *to, char *rest) {
 
 	size_t n = ll_node_index(from);
 	if (parse_defaults) {
-		io_write_line(stdout, "%ld\t%s", n, ll_s(global_current()));
-		return;
+		from = global_current();
+		to = ll_next(from, 1);
 	}
 	while (from != to) {
-		io_write_line(stdout, "%ld\t%s", n, ll_s(from));
+		io_write_line(stdout, "%ld\t", n);
+		io_write_buf(stdout, ll_s(from), ll_node_size(from));
 		from = ll_next(from, 1);
 		n++;
 	}
 }
 
-static size_t delete_aux(node_t *from, node_t *to) {
-	to = (to == global_tail() ? to : ll_next(to, 1));
-	from = (from == global_tail() ? ll_prev(from, 1) : from);
-	
-	size_t lines = 0;
-	push_to_delete_buf(&brake);
-	while (from != to) {
-		push_to_delete_buf(from);
-		from = ll_remove_shallow(from);
-		lines++;
-	}	
-	return lines;
-}
-
 void ed_delete(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('d');
-	delete_aux(from, to);
+	if (delete_bounds(&from, &to) == NULL) {
+		err_normal(&to_repl, "%s\n", "Invalid address");
+	}
+	range_record();
+	delete_range(from, to);
 	gbl_saved = 0;
 }
 
 void ed_change(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('c');
-	size_t lines = delete_aux(from, to);
-	append_aux(ll_prev(from, 1));
+	if (delete_bounds(&from, &to) == NULL) {
+		err_normal(&to_repl, "%s\n", "Invalid address");
+	}
+	range_record();
+	node_t *at = ll_prev(from, 1);
+	size_t lines = delete_range(from, to);
+	append_aux(at);
 	io_write_line(stdout, "%ld line%s changed\n", lines, (lines==1)?"":"s");
 	gbl_saved = 0;
 }
 
 
 void ed_move(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('m');
 	from = (from == global_head() ? ll_first_node() : from);
+	to = (to == global_tail() ? ll_last_node() : to);
 
 	if (*rest == '\n') {
 		err_normal(&to_repl, "%s\n", "ERROR: No arguments");
@@ -263,28 +482,33 @@ void ed_move(node_t *from, node_t *to, char *rest) {
 	free(pt);
 
 	move_to = (move_to == global_tail() ? ll_last_node(): move_to);
-	node_t *move_to_subsequent = ll_next(move_to, 1);
 
-	if (ll_node_index(move_to) <= ll_node_index(to)) {
-		err_normal(&to_repl, "%s\n", "Invalid Destination.");
+	/* Moving the range after its own last line leaves it where it is */
+	if (move_to == to) {
+		ll_set_current_node(to);
+		return;
 	}
+	/* The destination can be on either side, but not inside the range */
+	for (node_t *node = from; ; node = ll_next(node, 1)) {
+		if (node == move_to) {
+			err_normal(&to_repl, "%s\n", "Invalid Destination.");
+		}
+		if (node == to || node == global_tail()) {
+			break;
+		}
+	}
+	if (push_to_undo_buf('m')) {
+		push_to_append_buf(&brake);
+	}
+	node_t *move_to_subsequent = ll_next(move_to, 1);
 
-	push_to_append_buf(&brake);
 	push_to_append_buf(ll_prev(from, 1));
 	push_to_append_buf(from);
 	push_to_append_buf(to);
 	push_to_append_buf(ll_next(to, 1));
 	push_to_append_buf(move_to);
 	push_to_append_buf(move_to_subsequent);
-	/* 
-	 * from->prev <-> to->next
-	 * move_to <-> from 
-	 * to <-> move_to_subsequent
-	 */	
-
-	ll_attach_nodes(ll_prev(from, 1), ll_next(to, 1));
-	ll_attach_nodes(move_to, from);
-	ll_attach_nodes(to, move_to_subsequent);	
+	ll_move_range(from, to, move_to);
 	gbl_saved = 0;
 }
 
@@ -310,8 +534,9 @@ void ed_shell(node_t *from, node_t *to, char *rest) {
 
 	char *line = NULL;
 	size_t linecap;
-	while (io_read_line(&line, &linecap, fp, NULL) > 0) {
-		io_write_line(stdout, "%s", line);
+	ssize_t n;
+	while ((n = io_read_line(&line, &linecap, fp, NULL)) > 0) {
+		io_write_buf(stdout, line, n);
 	}
 	io_write_line(stdout, "!\n");
 	free(line);
@@ -357,6 +582,10 @@ int edit_aux(char *rest) {
 	/* Load new nodes */
 	io_load_file(fp);
 	frompipe == 1 ? pclose(fp) : fclose(fp);
+	/* errno is what this returns, the log has its own messages */
+	int errsv = errno;
+	rec_checkpoint(frompipe ? NULL : rest);
+	errno = errsv;
 end:
 	if (!dontfree) {
 		free(rest);
@@ -365,7 +594,7 @@ end:
 }
 
 void ed_edit(node_t *from, node_t *to, char *rest) {
-	if (!gbl_saved) {
+	if (modified()) {
 		err_normal(&to_repl, "%s", 
 				"No write since last change. Use 'E' to override or save changes.\n");
 	}
@@ -379,7 +608,7 @@ void ed_edit(node_t *from, node_t *to, char *rest) {
 	if (edit_aux(rest) != 0) {
 		err_normal(&to_repl, "%s\n", strerror(errno));
 	}
-	gbl_saved = 1;
+	set_saved();
 }
 
 void ed_edit_force(node_t *from, node_t *to, char *rest) {
@@ -399,27 +628,40 @@ void ed_file(node_t *from, node_t *to, char *rest) {
 	set_default_filename(rest);
 }
 
+/* 
+ * The joined line replaces the lines from..to, which go to the range log
+ * as they are: undo puts them back without cutting the line up again
+ */
 void ed_join(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('j');
-	push_to_delete_buf(&brake);
-
-	node_t *from_next = ll_next(from, 1);
-	to = (to == global_tail() ? to : ll_next(to, 1));
-
-	while (from_next != to) {
-		push_to_delete_buf(from_next);
-		ll_join_nodes(from, from_next);
-		from_next = ll_next(from, 1);
+	if (delete_bounds(&from, &to) == NULL) {
+		err_normal(&to_repl, "%s\n", "Invalid address");
+	}
+	to = (to == global_head() ? ll_first_node() : to);
+	if (from == to) {
+		return;
+	}
+	node_t *joined = ll_joined(from, to);
+	range_record();
+	node_t *at = ll_prev(from, 1);
+	delete_range(from, to);
+	insert_range(at, joined, joined, 1, ll_node_size(joined));
+	/* A mark on any of the lines now marks the line they became */
+	for (node_t *node = from; ; node = ll_next(node, 1)) {
+		move_marks(node, joined);
+		if (node == to) {
+			break;
+		}
 	}
 	gbl_saved = 0;
 }
 
 void ed_quit(node_t *from, node_t *to, char *rest) {
-	if (!gbl_saved) {
+	if (modified()) {
 		err_normal(&to_repl, "%s", 
 				"No write since last change." 
 				" Use 'Q' to quit without saving or save changes.\n");
 	}
+	rec_close();
 	exit(EXIT_SUCCESS);
 }
 
@@ -429,7 +671,6 @@ void ed_quit_force(node_t *from, node_t *to, char *rest) {
 }
 
 void ed_read(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('r');
 	FILE *fp;
 	_Bool frompipe = 0;
 	if (*rest == '!') {
@@ -443,16 +684,24 @@ void ed_read(node_t *from, node_t *to, char *rest) {
 	}
 
 	char *line = NULL;
+	ssize_t n;
 	size_t linecap;
+	size_t lines = 0;
+	size_t bytes = 0;
+	node_t *first = NULL;
+	node_t *last = NULL;
 
 	from = (from == global_tail() ? ll_last_node() : from);
-	push_to_append_buf(&brake);
-	while (io_read_line(&line, &linecap, fp, NULL) > 0) {
-		from = ll_add_next(from, line);
-		push_to_append_buf(from);
+	while ((n = io_read_line(&line, &linecap, fp, NULL)) > 0) {
+		last = ll_chain(last, line, n);
+		first = (first == NULL ? last : first);
+		lines++;
+		bytes += n;
 	}
 	free(line);
 	frompipe == 1 ? pclose(fp) : fclose(fp);
+	range_record();
+	insert_range(from, first, last, lines, bytes);
 }
 
 
@@ -494,11 +743,14 @@ void ed_write(node_t *from, node_t *to, char *rest) {
 
 	to = (to == global_tail() ? to : ll_next(to, 1));
 	while (from != to) {
-		fprintf(fp, "%s", ll_s(from));
+		fwrite(ll_s(from), 1, ll_node_size(from), fp);
 		from = ll_next(from, 1);
 	}
-	gbl_saved = 1;
+	set_saved();
 	frompipe == 1 ? pclose(fp) : fclose(fp);
+	if (!frompipe) {
+		rec_wrote(rest, parse_defaults);
+	}
 	if (quit) {
 		ed_quit(NULL, NULL, NULL);
 	}
@@ -530,11 +782,12 @@ void ed_write_append(node_t *from, node_t *to, char *rest) {
 
 	to = (to == global_tail() ? to : ll_next(to, 1));
 	while (from != to) {
-		fprintf(fp, "%s", ll_s(from));
+		fwrite(ll_s(from), 1, ll_node_size(from), fp);
 		from = ll_next(from, 1);
 	}
-	gbl_saved = 1;
+	set_saved();
 	frompipe == 1 ? pclose(fp) : fclose(fp);
+	rec_wrote(rest, 0);
 	if (quit) {
 		ed_quit(NULL, NULL, NULL);
 	}
@@ -557,7 +810,6 @@ void ed_semicolon(node_t *from, node_t *to, char *rest) {
 }
 
 void ed_transfer(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('t');
 	from = (from == global_head() ? ll_first_node() : from);
 	to = (to == global_tail() ? ll_last_node() : ll_next(to, 1));
 
@@ -568,17 +820,20 @@ void ed_transfer(node_t *from, node_t *to, char *rest) {
 
 	move_to = (move_to == global_tail() ? ll_last_node(): move_to);
 
-	push_to_delete_buf(&brake);
+	/* Copy the whole range before splicing, 'move_to' may be in it */
+	size_t lines = 0;
+	size_t bytes = 0;
+	node_t *first = NULL;
+	node_t *last = NULL;
 	while (from != to) {
-		push_to_delete_buf(from);
+		last = ll_chain_shared(last, from);
+		first = (first == NULL ? last : first);
+		lines++;
+		bytes += ll_node_size(from);
 		from = ll_next(from, 1);
 	}
-
-	push_to_append_buf(&brake);
-	while ((from = pop_delete_buf()) != &brake) {
-		push_to_append_buf(ll_add_next(move_to, ll_s(from)));
-	}
-
+	range_record();
+	insert_range(move_to, first, last, lines, bytes);
 	gbl_saved = 0;
 }
 
@@ -586,18 +841,31 @@ void ed_yank(node_t *from, node_t *to, char *rest) {
 	from = (from == global_head() ? ll_first_node() : from);
 	to = (to == global_tail() ? ll_last_node() : ll_next(to, 1));
 
-	yank_buf_clear();
+	_Bool append;
+	reg_t *reg = reg_of(rest, &append);
+	if (!append) {
+		reg_clear(reg);
+	}
 	while (from != to) {
-		yank_buf_push(ll_s(from));
+		reg_push(reg, from);
 		from = ll_next(from, 1);
 	}
 }
 
 
 void ed_paste(node_t *from, node_t *to, char *rest) {
-	for (int i = 0; i < (int)yb_nmembs(gbl_yank_buf); ++i) {
-		from = ll_add_next(from, yank_buf_get(i));
+	from = (from == global_tail() ? ll_last_node() : from);
+	_Bool append;
+	reg_t *reg = reg_of(rest, &append);
+	node_t *first = NULL;
+	node_t *last = NULL;
+	for (node_t *node = reg->first; node != NULL; node = ll_next(node, 1)) {
+		last = ll_chain_shared(last, node);
+		first = (first == NULL ? last : first);
 	}
+	range_record();
+	insert_range(from, first, last, reg->lines, reg->bytes);
+	gbl_saved = 0;
 }
 
 /*
@@ -617,29 +885,141 @@ void ed_paste(node_t *from, node_t *to, char *rest) {
 
 int gbl_total_substitutions = 0;
 
-void ed_subs(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('s');
+/* Lines handed to the workers at a time, bounds the memory of ed_subs() */
+#define SUBS_BATCH (PAR_THRESHOLD * 16)
 
-#if 0
-	if (parse_defaults) {
-		from = ll_first_node();
-		to = ll_last_node();
+/*
+ * Workers can't raise errors. They leave an errno value in their slot of a
+ * job's 'error' and stop; the calling thread raises it once par_for() is 
+ * done. Return the first one, 0 if there is none.
+ */
+static int par_error(int *error) {
+	for (int w = 0; w < PAR_MAX_WORKERS; ++w) {
+		if (error[w] != 0) {
+			return error[w];
+		}
+	}
+	return 0;
+}
+
+/* 
+ * Give worker 'worker' its own copy of the regex of 're' in 'clone', or the
+ * regex itself for worker 0, the calling thread. Return NULL if it fails, a 
+ * pattern that compiled once can only fail for want of memory.
+ */
+static regex_t *par_regex(re_t *re, regex_t *clone, int worker) {
+	if (worker == 0) {
+		return re_regex(re);
+	}
+	return (re_clone(re, clone) == 0 ? clone : NULL);
+}
+
+typedef struct subs_job {
+	re_t *re;
+	node_t **nodes;
+	/* out[i] is the new node for nodes[i], NULL if the line doesn't change */
+	node_t **out;
+	char *subst;
+	int error[PAR_MAX_WORKERS];
+} subs_job;
+
+static void subs_worker(void *arg, size_t lo, size_t hi, int worker) {
+	subs_job *job = arg;
+	for (size_t i = lo; i < hi; ++i) {
+		job->out[i] = NULL;
+	}
+	regex_t clone;
+	regex_t *reg = par_regex(job->re, &clone, worker);
+	if (reg == NULL) {
+		job->error[worker] = ENOMEM;
+		return;
+	}
+	char *line;
+	char *s;
+	size_t len;
+	size_t size;
+	for (size_t i = lo; i < hi; ++i) {
+		line = ll_s(job->nodes[i]);
+		len = ll_node_size(job->nodes[i]);
+		if (ll_filter_skip(job->nodes[i]) || !re_match_r(job->re, reg, line, len)) {
+			continue;
+		}
+		s = re_replace_r(job->re, reg, line, len, job->subst, &size);
+		if (s == NULL) {
+			job->error[worker] = ENOMEM;
+			break;
+		}
+		if (size == len && memcmp(s, line, len) == 0) {
+			free(s);
+			continue;
+		}
+		if ((job->out[i] = ll_adopt_shallow(s, size)) == NULL) {
+			job->error[worker] = ENOMEM;
+			break;
+		}
+	}
+	if (reg == &clone) {
+		regfree(&clone);
+	}
+}
+
+/*
+ * Substitute in the 'n' nodes of 'nodes', which must be in list order. The
+ * caller prepares the search filters for 're' with ll_filter_set().
+ * Replacements are built by the workers, then spliced into the list and the
+ * undo buffers in order, here. Only lines that change are replaced. Add
+ * the number of lines substituted to 'lines' and set 'last' to the last new
+ * node. If a worker failed nothing is replaced and its errno is returned, 
+ * for the caller to raise once it has cleaned up.
+ */
+static int subs_nodes(re_t *re, node_t **nodes, node_t **out, size_t n, 
+		char *subst, node_t **last, size_t *lines) {
+	subs_job job;
+	job.re = re;
+	job.nodes = nodes;
+	job.out = out;
+	job.subst = subst;
+	memset(job.error, 0, sizeof(job.error));
+	par_for(n, subs_worker, &job);
+
+	int error = par_error(job.error);
+	if (error != 0) {
+		for (size_t i = 0; i < n; ++i) {
+			if (out[i] != NULL) {
+				ll_free_node(out[i]);
+			}
+		}
+		return error;
 	}
-#endif
-	from = (from == global_head() ? ll_first_node() : from);
-	to = (to == global_tail() ? to : ll_next(to, 1));
 
 	node_t *new;
+	for (size_t i = 0; i < n; ++i) {
+		if (out[i] == NULL) {
+			continue;
+		}
+		new = out[i];
+		ll_replace_node(nodes[i], new);
+		push_to_delete_buf(nodes[i]);
+		push_to_append_buf(new);
+		if (re_print(re)) {
+			io_write_buf(stdout, ll_s(new), ll_node_size(new));
+		}
+		*last = new;
+		(*lines)++;
+	}
+	return 0;
+}
 
+char *subs_compile(re_t *re, char *rest) {
 	char *subst;
 	char *tail;
 	if (*rest == '\n' || isdigit(*rest) || *rest == 'r' || *rest == 'g' || *rest == 'p') {
-		if (re_has_subst(gbl_re) == 0) {
+		if (re_has_subst(re) == 0) {
 			err_normal(&to_repl, "%s\n", "No previous substitutions");
 		}
-		subst = ds_get_s(re_get_subst(gbl_re));
+		subst = ds_get_s(re_get_subst(re));
 		tail = rest;
-		parse_tail_alt(gbl_re, tail);
+		parse_tail_alt(re, tail);
 		goto end;
 	}
 
@@ -648,58 +1028,140 @@ void ed_subs(node_t *from, node_t *to, char *rest) {
 	subst = next_unescaped_delimiter(regex, delimiter);
 	tail = next_unescaped_delimiter(subst, delimiter);
 
-	parse_regex(gbl_re, regex);
-	parse_tail(gbl_re, tail);
+	re_set_icase(re, tail != NULL && strchr(tail, 'I') != NULL);
+	parse_regex(re, regex);
+	parse_tail(re, tail);
+	re_set_subst(re, subst);
 
 end:
-	//copy = ll_prev(from, 1);
-	push_to_delete_buf(&brake);
-	push_to_append_buf(&brake);
-	while (from != to) {
-		push_to_delete_buf(from);
+	return (subst == NULL ? "" : subst);
+}
 
-		new = ll_make_shallow(re_replace(gbl_re, ll_s(from), subst));
-		ll_attach_nodes(ll_prev(from, 1), new);
-		ll_attach_nodes(new, ll_next(from, 1));
+re_t *subs_last() {
+	return gbl_re;
+}
 
-		push_to_append_buf(from);
-		from = ll_next(new, 1);
+size_t subs_line(re_t *re, node_t *node, char *subst) {
+	if (push_to_undo_buf('s')) {
+		push_to_delete_buf(&brake);
+		push_to_append_buf(&brake);
 	}
-	gbl_saved = 0;
+	node_t *out;
+	node_t *last;
+	size_t lines = 0;
+	/* Not worth preparing the filters for a single line */
+	ll_filter_set(NULL);
+	int error = subs_nodes(re, &node, &out, 1, subst, &last, &lines);
+	if (error != 0) {
+		err(&to_repl, strerror(error));
+	}
+	if (lines > 0) {
+		ll_set_current_node(last);
+		gbl_saved = 0;
+	}
+	return lines;
 }
 
+void ed_subs(node_t *from, node_t *to, char *rest) {
+	_Bool fresh = push_to_undo_buf('s');
 
-void ed_global(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('g');
-	regex_t reg;
-	rest = parse_global_command(&reg, rest);
-
+#if 0
 	if (parse_defaults) {
 		from = ll_first_node();
 		to = ll_last_node();
 	}
+#endif
 	from = (from == global_head() ? ll_first_node() : from);
 	to = (to == global_tail() ? to : ll_next(to, 1));
 
-	node_t *node;
-	read_command_list(gbl_global_cmd_buf, rest);
-	while (from != to) {
-		node = ll_reg_next(from, &reg);	
-		if (node == NULL) {
-			break;
+	char *subst = subs_compile(gbl_re, rest);
+	if (fresh) {
+		push_to_delete_buf(&brake);
+		push_to_append_buf(&brake);
+	}
+
+	node_t **nodes = malloc(SUBS_BATCH * sizeof(*nodes));
+	node_t **out = malloc(SUBS_BATCH * sizeof(*out));
+	if (nodes == NULL || out == NULL) {
+		free(nodes);
+		free(out);
+		err(&to_repl, strerror(errno));
+	}
+
+	/* 
+	 * Only lines that the substitution actually changes are replaced, 
+	 * everything else is left alone and never reaches the undo buffers.
+	 */
+	size_t lines = 0;
+	size_t n;
+	node_t *last = NULL;
+	int error = 0;
+	ll_filter_set(re_literal(gbl_re));
+	while (from != to && error == 0) {
+		for (n = 0; from != to && n < SUBS_BATCH; ++n) {
+			nodes[n] = from;
+			from = ll_next(from, 1);
 		}
-		execute_command_list(gbl_global_cmd_buf, node);
-		from = ll_next(node, 1);
+		error = subs_nodes(gbl_re, nodes, out, n, subst, &last, &lines);
 	}
-	push_to_undo_buf('g');
-	gbl_saved = 0;
+	free(nodes);
+	free(out);
+
+	if (lines > 0) {
+		ll_set_current_node(last);
+		gbl_saved = 0;
+	}
+	if (error != 0) {
+		err(&to_repl, strerror(error));
+	}
+	io_write_line(stdout, "%ld line%s substituted\n", lines, (lines==1)?"":"s");
 }
 
-void ed_global_interact(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('g');
-	regex_t reg;
-	rest = parse_global_command(&reg, rest);
 
+/*
+ * 'rest' should be of the form [delimiter][RE][delimiter][I]
+ *
+ * 		Count the lines that match [RE] and the matches in them, without
+ * 		touching the buffer, the current line or the undo buffers. The 
+ * 		lines are shared out among the workers.
+ */
+
+typedef struct count_job {
+	node_t **nodes;
+	/* Per worker tallies, summed up once the workers are done */
+	size_t lines[PAR_MAX_WORKERS];
+	size_t matches[PAR_MAX_WORKERS];
+	int error[PAR_MAX_WORKERS];
+} count_job;
+
+static void count_worker(void *arg, size_t lo, size_t hi, int worker) {
+	count_job *job = arg;
+	regex_t clone;
+	regex_t *reg = par_regex(gbl_count_re, &clone, worker);
+	if (reg == NULL) {
+		job->error[worker] = ENOMEM;
+		return;
+	}
+	size_t m;
+	for (size_t i = lo; i < hi; ++i) {
+		if (ll_filter_skip(job->nodes[i])) {
+			continue;
+		}
+		m = re_count_r(gbl_count_re, reg, ll_s(job->nodes[i]), 
+				ll_node_size(job->nodes[i]));
+		job->lines[worker] += (m > 0);
+		job->matches[worker] += m;
+	}
+	if (reg == &clone) {
+		regfree(&clone);
+	}
+}
+
+void ed_count(node_t *from, node_t *to, char *rest) {
+	if (*rest == '\n' || *rest == '\0') {
+		err_normal(&to_repl, "%s\n", "No regular expression");
+	}
+	parse_global_command(gbl_count_re, rest);
 	if (parse_defaults) {
 		from = ll_first_node();
 		to = ll_last_node();
@@ -707,53 +1169,356 @@ void ed_global_interact(node_t *from, node_t *to, char *rest) {
 	from = (from == global_head() ? ll_first_node() : from);
 	to = (to == global_tail() ? to : ll_next(to, 1));
 
-	node_t *node;
-	rest[strlen(rest) - 2] = '\\';
+	node_t **nodes = malloc(SUBS_BATCH * sizeof(*nodes));
+	count_job *job = calloc(1, sizeof(*job));
+	if (nodes == NULL || job == NULL) {
+		free(nodes);
+		free(job);
+		err(&to_repl, strerror(errno));
+	}
+	job->nodes = nodes;
+
+	ll_filter_set(re_literal(gbl_count_re));
+	size_t n;
+	int error = 0;
+	while (from != to && error == 0) {
+		for (n = 0; from != to && n < SUBS_BATCH; ++n) {
+			nodes[n] = from;
+			from = ll_next(from, 1);
+		}
+		par_for(n, count_worker, job);
+		error = par_error(job->error);
+	}
+	if (error != 0) {
+		free(nodes);
+		free(job);
+		err(&to_repl, strerror(error));
+	}
+	size_t lines = 0;
+	size_t matches = 0;
+	for (int i = 0; i < PAR_MAX_WORKERS; ++i) {
+		lines += job->lines[i];
+		matches += job->matches[i];
+	}
+	free(nodes);
+	free(job);
+	io_write_line(stdout, "%ld line%s, %ld match%s\n", lines, 
+			(lines==1)?"":"s", matches, (matches==1)?"":"es");
+}
+
+
+/* 
+ * Global commands run in two phases, like POSIX ed requires. The mark phase
+ * matches every line of the range against the regex, on the workers, and 
+ * marks the lines that will be visited. The execution phase then runs the 
+ * command list on each line that is still marked; lines removed by an 
+ * earlier command lose their mark and are skipped.
+ */
+
+typedef struct mark_job {
+	node_t **nodes;
+	char *match;
+	_Bool invert;
+	int error[PAR_MAX_WORKERS];
+} mark_job;
+
+static void mark_worker(void *arg, size_t lo, size_t hi, int worker) {
+	mark_job *job = arg;
+	regex_t clone;
+	regex_t *reg = par_regex(gbl_global_re, &clone, worker);
+	if (reg == NULL) {
+		job->error[worker] = ENOMEM;
+		return;
+	}
+	for (size_t i = lo; i < hi; ++i) {
+		if (ll_filter_skip(job->nodes[i])) {
+			/* Can't match, no need to ask the regex */
+			job->match[i] = job->invert;
+			continue;
+		}
+		job->match[i] = (re_match_r(gbl_global_re, reg, ll_s(job->nodes[i]),
+			 ll_node_size(job->nodes[i])) != job->invert);
+	}
+	if (reg == &clone) {
+		regfree(&clone);
+	}
+}
+
+static void marked_push(size_t i, node_t *node) {
+	if (i >= gbl_marked_sz) {
+		size_t sz = (gbl_marked_sz == 0 ? SUBS_BATCH : gbl_marked_sz * 2);
+		node_t **tmp = realloc(gbl_marked, sz * sizeof(*gbl_marked));
+		if (tmp == NULL) {
+			err(&to_repl, strerror(errno));
+		}
+		gbl_marked = tmp;
+		gbl_marked_sz = sz;
+	}
+	gbl_marked[i] = node;
+}
+
+/* Mark the lines between 'from' and 'to' (exclusive); return their count */
+static size_t global_mark(node_t *from, node_t *to, _Bool invert) {
+	node_t **nodes = malloc(SUBS_BATCH * sizeof(*nodes));
+	char *match = malloc(SUBS_BATCH * sizeof(*match));
+	if (nodes == NULL || match == NULL) {
+		free(nodes);
+		free(match);
+		err(&to_repl, strerror(errno));
+	}
+
+	ll_filter_set(re_literal(gbl_global_re));
+
+	mark_job job;
+	job.nodes = nodes;
+	job.match = match;
+	job.invert = invert;
+	memset(job.error, 0, sizeof(job.error));
 
+	size_t marked = 0;
+	size_t n;
+	int error;
 	while (from != to) {
-		node = ll_reg_next(from, &reg);	
-		if (node == NULL) {
-			break;
+		for (n = 0; from != to && n < SUBS_BATCH; ++n) {
+			nodes[n] = from;
+			from = ll_next(from, 1);
+		}
+		par_for(n, mark_worker, &job);
+		if ((error = par_error(job.error)) != 0) {
+			for (size_t i = 0; i < marked; ++i) {
+				ll_set_mark(gbl_marked[i], 0);
+			}
+			free(nodes);
+			free(match);
+			err(&to_repl, strerror(error));
+		}
+		for (size_t i = 0; i < n; ++i) {
+			if (match[i]) {
+				ll_set_mark(nodes[i], 1);
+				marked_push(marked++, nodes[i]);
+			}
 		}
-		io_write_line(stdout, "%s", ll_s(node));
-		read_command_list(gbl_global_cmd_buf, rest);
-		execute_command_list(gbl_global_cmd_buf, node);
-		from = ll_next(node, 1);
 	}
-	push_to_undo_buf('g');
-	gbl_saved = 0;
+	free(nodes);
+	free(match);
+	return marked;
 }
 
-void ed_global_invert(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('g');
-	regex_t reg;
-	rest = parse_global_command(&reg, rest);
+/* Is 's' nothing but blanks up to the end of the command */
+static _Bool at_end(char *s) {
+	s = skipspaces(s);
+	return *s == '\n' || *s == '\0';
+}
 
-	if (parse_defaults) {
-		from = ll_first_node();
-		to = ll_last_node();
+/*
+ * A command list that is a single d, m$ or s is run over all the marked 
+ * lines at once and recorded as one undo record, instead of being parsed and
+ * evaluated for every line. Return 0 if 'cmd' isn't one of those.
+ */
+static _Bool global_bulk(char *cmd, size_t marked) {
+	node_t *node;
+	cmd = skipspaces(cmd);
+	if (*cmd == 'd' && at_end(cmd + 1)) {
+		/* Adjacent marked lines go to the range log as one run */
+		range_record();
+		size_t bytes;
+		size_t j;
+		for (size_t i = 0; i < marked; i = j) {
+			node = gbl_marked[i];
+			ll_set_mark(node, 0);
+			bytes = ll_node_size(node);
+			for (j = i + 1; j < marked && 
+					gbl_marked[j] == ll_next(gbl_marked[j - 1], 1); ++j) {
+				ll_set_mark(gbl_marked[j], 0);
+				bytes += ll_node_size(gbl_marked[j]);
+			}
+			ll_detach_range(node, gbl_marked[j - 1], j - i);
+			push_to_range_log(node, gbl_marked[j - 1], j - i, bytes, 0);
+		}
+		return 1;
 	}
-	from = (from == global_head() ? ll_first_node() : from);
-	to = (to == global_tail() ? to : ll_next(to, 1));
+	if (*cmd == 'm' && *skipspaces(cmd + 1) == '$' && at_end(skipspaces(cmd + 1) + 1)) {
+		/* Adjacent marked lines go to the end as one run, see un_move_bulk() */
+		push_to_undo_buf('M');
+		push_to_append_buf(&brake);
+		size_t j;
+		for (size_t i = 0; i < marked; i = j) {
+			node = gbl_marked[i];
+			ll_set_mark(node, 0);
+			for (j = i + 1; j < marked && 
+					gbl_marked[j] == ll_next(gbl_marked[j - 1], 1); ++j) {
+				ll_set_mark(gbl_marked[j], 0);
+			}
+			push_to_append_buf(ll_prev(node, 1));
+			push_to_append_buf(node);
+			push_to_append_buf(gbl_marked[j - 1]);
+			if (gbl_marked[j - 1] != ll_last_node()) {
+				ll_move_range(node, gbl_marked[j - 1], ll_last_node());
+			}
+		}
+		ll_set_current_node(ll_last_node());
+		return 1;
+	}
+	if (*cmd == 's') {
+		push_to_undo_buf('s');
+		/* compile_command_list() left the substitution of the list here */
+		char *subst = ds_get_s(re_get_subst(gbl_re));
+		subst = (subst == NULL ? "" : subst);
+		push_to_delete_buf(&brake);
+		push_to_append_buf(&brake);
+
+		node_t **out = malloc(SUBS_BATCH * sizeof(*out));
+		if (out == NULL) {
+			err(&to_repl, strerror(errno));
+		}
+		size_t lines = 0;
+		size_t n;
+		node_t *last = NULL;
+		int error = 0;
+		ll_filter_set(re_literal(gbl_re));
+		for (size_t i = 0; i < marked && error == 0; i += n) {
+			n = (marked - i < SUBS_BATCH ? marked - i : SUBS_BATCH);
+			error = subs_nodes(gbl_re, gbl_marked + i, out, n, subst, &last, &lines);
+		}
+		free(out);
+		for (size_t i = 0; i < marked; ++i) {
+			ll_set_mark(gbl_marked[i], 0);
+		}
+		if (lines > 0) {
+			ll_set_current_node(last);
+		}
+		if (error != 0) {
+			err(&to_repl, strerror(error));
+		}
+		io_write_line(stdout, "%ld line%s substituted\n", lines, (lines==1)?"":"s");
+		return 1;
+	}
+	return 0;
+}
 
+/*
+ * g/RE/p, g/RE/n and g/RE/ (which prints too) leave the buffer alone, so 
+ * they need neither marks nor undo records. The workers format the lines 
+ * of their chunk into a buffer each, and the buffers are written out in 
+ * chunk order, a batch at a time.
+ */
+
+typedef struct print_job {
+	node_t **nodes;
+	/* Line number of nodes[0] */
+	size_t first;
+	_Bool number;
+	_Bool invert;
+	ds_t *out[PAR_MAX_WORKERS];
+	node_t *last[PAR_MAX_WORKERS];
+	int error[PAR_MAX_WORKERS];
+} print_job;
+
+static void print_worker(void *arg, size_t lo, size_t hi, int worker) {
+	print_job *job = arg;
+	regex_t clone;
+	regex_t *reg = par_regex(gbl_global_re, &clone, worker);
+	if (reg == NULL) {
+		job->error[worker] = ENOMEM;
+		return;
+	}
+	ds_t *out = job->out[worker];
+	char num[32];
+	int len;
 	node_t *node;
-	read_command_list(gbl_global_cmd_buf, rest);
-	while (from != to) {
-		node = ll_reg_next_invert(from, &reg);	
-		if (node == NULL) {
+	_Bool match;
+	for (size_t i = lo; i < hi; ++i) {
+		node = job->nodes[i];
+		match = !ll_filter_skip(node) && 
+			re_match_r(gbl_global_re, reg, ll_s(node), ll_node_size(node));
+		if (match == job->invert) {
+			continue;
+		}
+		if (job->number) {
+			len = snprintf(num, sizeof(num), "%ld\t", job->first + i);
+			ds_cat_n(out, num, len);
+		}
+		ds_cat_n(out, ll_s(node), ll_node_size(node));
+		if (ds_failed(out)) {
+			job->error[worker] = ENOMEM;
 			break;
 		}
-		execute_command_list(gbl_global_cmd_buf, node);
-		from = ll_next(node, 1);
+		job->last[worker] = node;
+	}
+	if (reg == &clone) {
+		regfree(&clone);
 	}
-	gbl_saved = 0;
-	push_to_undo_buf('g');
 }
 
-void ed_global_interact_invert(node_t *from, node_t *to, char *rest) {
-	push_to_undo_buf('g');
-	regex_t reg;
-	rest = parse_global_command(&reg, rest);
+/* Is the command list 'cmd' a lone p, n or nothing; set 'number' for n */
+static _Bool print_only(char *cmd, _Bool *number) {
+	cmd = skipspaces(cmd);
+	*number = (*cmd == 'n');
+	return at_end(cmd) || ((*cmd == 'p' || *cmd == 'n') && at_end(cmd + 1));
+}
+
+static void global_print(node_t *from, node_t *to, _Bool invert, _Bool number) {
+	/* An empty buffer leaves 'from' on the tail, which has no index */
+	if (ll_len() == 0 || from == to) {
+		return;
+	}
+	node_t **nodes = malloc(SUBS_BATCH * sizeof(*nodes));
+	print_job *job = calloc(1, sizeof(*job));
+	if (nodes == NULL || job == NULL) {
+		free(nodes);
+		free(job);
+		err(&to_repl, strerror(errno));
+	}
+	int workers = par_nworkers();
+	for (int w = 0; w < workers; ++w) {
+		job->out[w] = ds_make();
+	}
+	job->nodes = nodes;
+	job->number = number;
+	job->invert = invert;
+	job->first = (number ? (size_t)ll_node_index(from) : 0);
+
+	ll_filter_set(re_literal(gbl_global_re));
+	node_t *last = NULL;
+	size_t n;
+	int error = 0;
+	while (from != to && error == 0) {
+		for (n = 0; from != to && n < SUBS_BATCH; ++n) {
+			nodes[n] = from;
+			from = ll_next(from, 1);
+		}
+		par_for(n, print_worker, job);
+		/* Output stops in front of the chunk of a worker that failed */
+		error = par_error(job->error);
+		for (int w = 0; w < workers && job->error[w] == 0; ++w) {
+			if (ds_nmembs(job->out[w]) > 0) {
+				io_write_buf(stdout, ds_get_s(job->out[w]), ds_nmembs(job->out[w]));
+				ds_clear(job->out[w]);
+			}
+			if (job->last[w] != NULL) {
+				last = job->last[w];
+				job->last[w] = NULL;
+			}
+		}
+		job->first += n;
+	}
+	if (last != NULL) {
+		ll_set_current_node(last);
+	}
+	for (int w = 0; w < workers; ++w) {
+		ds_free(job->out[w]);
+		free(job->out[w]);
+	}
+	free(nodes);
+	free(job);
+	if (error != 0) {
+		err(&to_repl, strerror(error));
+	}
+}
+
+static void global_aux(node_t *from, node_t *to, char *rest, _Bool invert,
+		_Bool interact) {
+	rest = parse_global_command(gbl_global_re, rest);
 
 	if (parse_defaults) {
 		from = ll_first_node();
@@ -762,27 +1527,96 @@ void ed_global_interact_invert(node_t *from, node_t *to, char *rest) {
 	from = (from == global_head() ? ll_first_node() : from);
 	to = (to == global_tail() ? to : ll_next(to, 1));
 
-	node_t *node;
-	rest[strlen(rest) - 2] = '\\';
+	_Bool number;
+	if (!interact && print_only(rest, &number)) {
+		global_print(from, to, invert, number);
+		return;
+	}
 
-	while (from != to) {
-		node = ll_reg_next_invert(from, &reg);	
-		if (node == NULL) {
-			break;
-		}
-		io_write_line(stdout, "%s", ll_s(node));
+	push_to_undo_buf('g');
+
+	if (interact) {
+		rest[strlen(rest) - 2] = '\\';
+	}
+	else {
 		read_command_list(gbl_global_cmd_buf, rest);
-		execute_command_list(gbl_global_cmd_buf, node);
-		from = ll_next(node, 1);
+		compile_command_list(gbl_global_ops, gbl_global_cmd_buf);
+	}
+
+	size_t marked = global_mark(from, to, invert);
+	if (!interact && yb_nmembs(gbl_global_cmd_buf) == 1 && 
+			global_bulk(yb_at(gbl_global_cmd_buf, 0), marked)) {
+		push_to_undo_buf('g');
+		gbl_saved = 0;
+		return;
+	}
+
+	node_t *node;
+	/* 
+	 * Lines changed by s are counted over the whole command, as 
+	 * global_bulk() counts them
+	 */
+	_Bool subs = ol_runs(gbl_global_ops, 's');
+	size_t lines = 0;
+	for (size_t i = 0; i < marked; ++i) {
+		node = gbl_marked[i];
+		if (!ll_marked(node)) {
+			continue;
+		}
+		ll_set_mark(node, 0);
+		if (interact) {
+			io_write_buf(stdout, ll_s(node), ll_node_size(node));
+			read_command_list(gbl_global_cmd_buf, rest);
+			compile_command_list(gbl_global_ops, gbl_global_cmd_buf);
+			subs = subs || ol_runs(gbl_global_ops, 's');
+		}
+		lines += execute_command_list(gbl_global_ops, node);
 	}
-	gbl_saved = 0;
 	push_to_undo_buf('g');
+	gbl_saved = 0;
+	if (subs) {
+		io_write_line(stdout, "%ld line%s substituted\n", lines, (lines==1)?"":"s");
+	}
 }
 
+void ed_global(node_t *from, node_t *to, char *rest) {
+	global_aux(from, to, rest, 0, 0);
+}
+
+void ed_global_interact(node_t *from, node_t *to, char *rest) {
+	global_aux(from, to, rest, 0, 1);
+}
+
+void ed_global_invert(node_t *from, node_t *to, char *rest) {
+	global_aux(from, to, rest, 1, 0);
+}
+
+void ed_global_interact_invert(node_t *from, node_t *to, char *rest) {
+	global_aux(from, to, rest, 1, 1);
+}
+
+/* u undoes a step, u N steps to state N of the history and ul lists it */
 void ed_undo(node_t *from, node_t *to, char *rest) {
-	undo();
+	rest = skipspaces(rest);
+	if (*rest == 'l') {
+		undo_list();
+		return;
+	}
+	if (isdigit(*rest)) {
+		undo_step_to(strtoul(rest, NULL, 10));
+	}
+	else {
+		undo();
+	}
+	gbl_saved = 0;
 }
 
 void ed_redo(node_t *from, node_t *to, char *rest) {
 	redo();
+	gbl_saved = 0;
+}
+
+void ed_session(node_t *from, node_t *to, char *rest) {
+	rest = remove_trailing_newlines(skipspaces(rest));
+	ses_save(*rest == '\0' || *rest == '\n' ? NULL : rest);
 }
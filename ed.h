@@ -2,6 +2,7 @@
 #define ED_H
 
 #include "ll.h"
+#include "aux.h"
 
 char *get_prompt();
 void set_prompt(char *s);
@@ -17,13 +18,39 @@ void append_command_buf(char *s);
 /* Initialize the ds_t buffers for various ed_ functions */
 void gbl_buffers_init();
 void gbl_buffers_free();
+/* 
+ * Write the buffers, marks and the default filename to a session image, or
+ * read them back, see ses.h
+ */
+void buffers_save();
+void buffers_load();
 
 int set_mark(node_t *node, int at);
 node_t *get_mark(int at);
 void clear_mark(int at);
+/* Clear the marks set on 'node', before it is freed */
+void clear_marks_at(node_t *node);
 
 int edit_aux(char *rest);
 
+/* 
+ * Parse the arguments of 's' into 're'; return the substitution template.
+ * 'rest' is cut up in the process.
+ */
+char *subs_compile(re_t *re, char *rest);
+/* The 're' of the last substitution, the one a bare s repeats */
+re_t *subs_last();
+/* 
+ * Substitute in 'node' with a compiled 're', as one 's' undo record. 
+ * Returns 1 if the line changed, else 0.
+ */
+size_t subs_line(re_t *re, node_t *node, char *subst);
+/* 
+ * a, i or c ('cmd') of a command list on 'node', with the lines yb[text] 
+ * up to yb[text + ntext]. Returns the last line put in, or the line before.
+ */
+node_t *list_text(char cmd, node_t *node, yb_t *yb, int text, int ntext);
+
 void ed_append(node_t *from, node_t *to, char *rest);
 void ed_print(node_t *from, node_t *to, char *rest);
 void ed_print_n(node_t *from, node_t *to, char *rest);
@@ -51,11 +78,13 @@ void ed_transfer(node_t *from, node_t *to, char *rest);
 void ed_yank(node_t *from, node_t *to, char *rest);
 void ed_paste(node_t *from, node_t *to, char *rest);
 void ed_subs(node_t *from, node_t *to, char *rest);
+void ed_count(node_t *from, node_t *to, char *rest);
 void ed_global(node_t *from, node_t *to, char *rest);
 void ed_global_interact(node_t *from, node_t *to, char *rest);
 void ed_global_invert(node_t *from, node_t *to, char *rest);
 void ed_global_interact_invert(node_t *from, node_t *to, char *rest);
 void ed_undo(node_t *from, node_t *to, char *rest);
 void ed_redo(node_t *from, node_t *to, char *rest);
+void ed_session(node_t *from, node_t *to, char *rest);
 
 #endif
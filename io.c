@@ -8,6 +8,10 @@
 #include "err.h"
 #include "ed.h"
 #include "aux.h"
+#include "par.h"
+#include "undo.h"
+#include "rec.h"
+#include "ses.h"
 
 #include <errno.h>
 #include <string.h>
@@ -92,13 +96,23 @@ int io_write_line(FILE *fp, const char *fmt, ...) {
 	return bytes_read;
 }
 
+int io_write_buf(FILE *fp, char *s, size_t n) {
+	/* Same stream as io_write_line(), so the two never get out of order */
+	size_t bytes_written = fwrite(s, 1, n, stderr);
+#if (ED_FLUSH_OUTPUT == 1)
+	fflush(fp);
+#endif
+	return bytes_written;
+}
+
 
 void io_load_file(FILE *fp) {
 	char *line = NULL;
 	size_t linecap;
+	ssize_t n;
 	node_t *node = global_head();
-	while (io_read_line(&line, &linecap, fp, NULL) > 0) {
-		node = ll_add_next(node, line);
+	while ((n = io_read_line(&line, &linecap, fp, NULL)) > 0) {
+		node = ll_add_next(node, line, n);
 	}
 	free(line);
 }
@@ -106,12 +120,9 @@ void io_load_file(FILE *fp) {
 void io_write_file(char *filename) {
 	FILE *fp = fileopen(filename, "a");
 
-	node_t *node = ll_next(global_head(), 1);
-	for (;;) {
-		io_write_line(fp, ll_s(node));
-		if (ll_next(node, 1) == global_tail()) {
-			break;
-		}
+	for (node_t *node = ll_first_node(); node != global_tail(); 
+			node = ll_next(node, 1)) {
+		fwrite(ll_s(node), 1, ll_node_size(node), fp);
 	}
 	fclose(fp);
 }
@@ -119,7 +130,9 @@ void io_write_file(char *filename) {
 char *parse_filename(char *filename) {
 	re_t *re = re_make();
 	parse_regex(re, "[^\\]%");
-	filename = re_replace(re, filename, get_default_filename());
+	size_t size;
+	filename = re_replace(re, filename, strlen(filename), 
+			get_default_filename(), &size);
 	free(re);
 	return filename;
 }
@@ -145,9 +158,17 @@ static const char *options_text = "Usage: edd [OPTIONS] [FILE]\n\n"
 "Options:\n"
 "-h       \tPrint this help message and exit\n"
 "-E       \tUse \"Extended Regular Expressions\"\n"
+"-b BITS  \tSearch filter bits per block of lines, up to 65536, 0 disables\n"
+"         \t(default: 256)\n"
+"-j N     \tUse N threads for substitutions (default: one per processor)\n"
 "-p STRING\tSet interactive prompt to STRING\n"
 "-r       \tRun edd in restricted mode\n"
-"-s       \tSilent error messages and diagnostics";
+"-s       \tSilent error messages and diagnostics\n"
+"-u BYTES \tKeep at most BYTES of deleted lines in memory for undo, the\n"
+"         \trest goes to a temporary file (default: no limit)\n"
+"-J FILE  \tLog changes to FILE as they are made, to recover them with\n"
+"         \tedd -J FILE after a crash\n"
+"-S FILE  \tRestore the session saved to FILE with 'S FILE'";
 
 static const char *more_information = "Try 'edd -h' for more information";
 
@@ -163,7 +184,7 @@ _Bool opt_extended = 0;
 _Bool opt_readline = ED_INCLUDE_READLINE;
 _Bool opt_history = ED_INCLUDE_HISTORY;
 
-static const char *optstring = "hEp:rsRH";
+static const char *optstring = "hEb:j:p:rsu:J:S:RH";
 
 int parse_args(int argc, char **argv) {
 #if 0
@@ -182,6 +203,12 @@ int parse_args(int argc, char **argv) {
 			case 'E':
 				opt_extended = 1;
 				break;
+			case 'b':
+				ll_filter_config(strtoul(optarg, NULL, 10));
+				break;
+			case 'j':
+				par_set_workers(atoi(optarg));
+				break;
 			case 'p':
 				set_prompt(optarg);
 				break;
@@ -191,6 +218,15 @@ int parse_args(int argc, char **argv) {
 			case 's':
 				opt_silent = 1;
 				break;
+			case 'u':
+				undo_journal_config(strtoul(optarg, NULL, 10));
+				break;
+			case 'J':
+				rec_config(optarg);
+				break;
+			case 'S':
+				ses_config(optarg);
+				break;
 			case 'R':
 				opt_readline = (opt_readline == 1 ? 0 : 1);
 				break;
@@ -15,6 +15,8 @@ void io_write_file(char *filename);
 ssize_t io_read_line(char **line, size_t *linecap, FILE *fp, char *prompt);
 /* printf() wrapper */
 int io_write_line(FILE *fp, const char *fmt, ...);
+/* Write the 'n' bytes at 's' in one go, where io_write_line() would */
+int io_write_buf(FILE *fp, char *s, size_t n);
 
 /* args */
 
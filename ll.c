@@ -1,8 +1,12 @@
 #include "ll.h"
+#include <stdio.h>
 #include <string.h>
 #include "err.h"
+#include "aux.h"
+#include "rec.h"
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <regex.h>
 
 /*
@@ -22,17 +26,73 @@ struct node_t{
 	char *s;
 	ssize_t size;
 	struct node_t *next;
+	/* Set by global commands on the lines they are about to visit */
+	_Bool mark;
+	/* Search filter block of this line, valid if gen matches, see below */
+	unsigned blk;
+	unsigned gen;
+	/* Id in the recovery log, see rec.c */
+	size_t rec;
 };
 
 node_t brake;
 
+/*
+ * Line text. The bytes of a line sit behind a count of the nodes sharing
+ * them: the copies t, y and x make of a line get the same bytes. No edit
+ * changes a line in place, a changed line is a new node, so the bytes are
+ * never written once shared. The string of a node is always one of these.
+ */
+typedef struct text_t {
+	size_t refs;
+	char s[];
+} text_t;
+
+#define TEXT(p) ((text_t *)((p) - offsetof(text_t, s)))
+
+char *ll_text_alloc(size_t size) {
+	text_t *t = malloc(sizeof(*t) + size + 1);
+	if (t == NULL) {
+		err(&to_repl, strerror(errno));
+	}
+	t->refs = 1;
+	t->s[size] = '\0';
+	return t->s;
+}
+
+char *ll_text_dup(char *s, size_t size) {
+	char *t = ll_text_alloc(size);
+	memcpy(t, s, size);
+	return t;
+}
+
+char *ll_text_adopt(char *s, size_t size) {
+	text_t *t = realloc(s, sizeof(*t) + size + 1);
+	if (t == NULL) {
+		err(&to_repl, strerror(errno));
+	}
+	memmove(t->s, t, size + 1);
+	t->refs = 1;
+	return t->s;
+}
+
+void ll_text_free(char *s) {
+	if (s != NULL && --TEXT(s)->refs == 0) {
+		free(TEXT(s));
+	}
+}
+
 static node_t *gbl_current_node;
 static node_t gbl_head_node;
 static node_t gbl_tail_node;
 static ssize_t gbl_len;
 
+static void filter_join(node_t *node, node_t *neighbour);
+static void filter_stale(size_t lines);
+
 void ll_free_node(node_t* node) {
-	free((char *)node->s);
+	rec_free(node);
+	ll_text_free(node->s);
 	free((node_t *)node);
 }
 
@@ -46,41 +106,38 @@ static node_t *ll_alloc_node(size_t size) {
 		/* Do not allocate space for the string */
 		goto end; 
 	}
-	/* +1 for null byte at the end */
-	node->s = calloc(size + 1, sizeof(*(node->s))); 
-	if (!node->s) {
-		err(&to_repl, strerror(errno));
-	}
+	node->s = ll_text_alloc(size);
 end:
 	return node;
 }
 
-node_t *ll_add_next(node_t *node,  char *s) {
-	node_t *newnode = ll_make_node(node, s, node->next);
+node_t *ll_add_next(node_t *node, char *s, size_t size) {
+	node_t *newnode = ll_make_node(node, s, size, node->next);
 	ll_attach_nodes(newnode, node->next);
 	ll_attach_nodes(node, newnode);
+	filter_join(newnode, node);
 	ll_set_current_node(newnode);	
 	gbl_len++;
 	return newnode;
 }
 
-node_t *ll_add_prev(node_t *node,  char *s) {
-	node_t *newnode = ll_make_node(node->prev, s, node);
-	node->prev->next = newnode;
-	node->prev = newnode;
+node_t *ll_add_prev(node_t *node, char *s, size_t size) {
+	node_t *newnode = ll_make_node(node->prev, s, size, node);
+	ll_attach_nodes(node->prev, newnode);
+	ll_attach_nodes(newnode, node);
+	filter_join(newnode, node);
 	ll_set_current_node(newnode);	
 	gbl_len++;
 	return newnode;
 }
 
-node_t *ll_make_node(node_t *prev, char *s, node_t *next) {
-	size_t size = (s == NULL ? 0 : strlen(s));
+node_t *ll_make_node(node_t *prev, char *s, size_t size, node_t *next) {
 	node_t *nd = ll_alloc_node(size);
 	nd->prev = prev;
 	nd->next = next;
 	nd->size = size;
 	if (size != 0) {
-		strncpy(nd->s, s, size + 1);
+		memcpy(nd->s, s, size);
 	}
 	ll_set_current_node(nd);	
 	return nd;
@@ -89,14 +146,13 @@ node_t *ll_make_node(node_t *prev, char *s, node_t *next) {
 node_t *ll_remove_node(node_t *node) {
 	node_t *prev_node = node->prev;
 	node_t *next_node = node->next;
-	if (prev_node != NULL) {
-		prev_node->next = next_node;
-	}
-	if (next_node != NULL) {
-		next_node->prev = prev_node;
+	if (prev_node != NULL && next_node != NULL) {
+		ll_attach_nodes(prev_node, next_node);
 	}
+	node->mark = 0;
 	ll_free_node(node);
 	ll_set_current_node(next_node);	
+	filter_stale(1);
 	gbl_len--;
 	return next_node;
 }	
@@ -104,6 +160,7 @@ node_t *ll_remove_node(node_t *node) {
 node_t *ll_remove_shallow(node_t *node) {
 	ll_detach_node(node);
 	ll_set_current_node(node->next);	
+	filter_stale(1);
 	gbl_len--;
 	return node->next;
 }
@@ -132,9 +189,10 @@ node_t *ll_prev(node_t *node, int offset) {
 	return node;
 }
 
-node_t *ll_reg_next(node_t *node, regex_t *reg) {
+node_t *ll_reg_next(node_t *node, re_t *re) {
+	ll_filter_set(re_literal(re));
 	for (node_t *nd = node; nd != global_tail(); nd = nd->next) {
-		if (regexec(reg, nd->s, 0, NULL, 0) == 0) {
+		if (!ll_filter_skip(nd) && re_match(re, nd->s, nd->size)) {
 			ll_set_current_node(nd);
 			return nd;
 		}
@@ -143,9 +201,10 @@ node_t *ll_reg_next(node_t *node, regex_t *reg) {
 	return NULL;
 }
 
-node_t *ll_reg_prev(node_t *node, regex_t *reg) {
+node_t *ll_reg_prev(node_t *node, re_t *re) {
+	ll_filter_set(re_literal(re));
 	for (node_t *nd = node; nd != global_head(); nd = nd->prev) {
-		if (regexec(reg, nd->s, 0, NULL, 0) == 0) {
+		if (!ll_filter_skip(nd) && re_match(re, nd->s, nd->size)) {
 			ll_set_current_node(nd);
 			return nd;
 		}
@@ -154,9 +213,35 @@ node_t *ll_reg_prev(node_t *node, regex_t *reg) {
 	return NULL;
 }
 
-node_t *ll_reg_next_invert(node_t *node, regex_t *reg) {
+node_t *ll_reg_search(node_t *node, re_t *re, _Bool backward) {
+	if (ll_first_node() == global_tail()) {
+		return NULL;
+	}
+	/* From either end, the search starts at the line on the other end */
+	if (node == global_head() || node == global_tail()) {
+		node = (backward ? ll_first_node() : ll_last_node());
+	}
+	ll_filter_set(re_literal(re));
+	node_t *nd = node;
+	do {
+		nd = (backward ? nd->prev : nd->next);
+		if (nd == global_tail()) {
+			nd = ll_first_node();
+		}
+		else if (nd == global_head()) {
+			nd = ll_last_node();
+		}
+		if (!ll_filter_skip(nd) && re_match(re, nd->s, nd->size)) {
+			ll_set_current_node(nd);
+			return nd;
+		}
+	} while (nd != node);
+	return NULL;
+}
+
+node_t *ll_reg_next_invert(node_t *node, re_t *re) {
 	for (node_t *nd = node; nd != global_tail(); nd = nd->next) {
-		if (regexec(reg, nd->s, 0, NULL, 0) != 0) {
+		if (!re_match(re, nd->s, nd->size)) {
 			ll_set_current_node(nd);
 			return nd;
 		}
@@ -165,9 +250,9 @@ node_t *ll_reg_next_invert(node_t *node, regex_t *reg) {
 	return NULL;
 }
 
-node_t *ll_reg_prev_invert(node_t *node, regex_t *reg) {
+node_t *ll_reg_prev_invert(node_t *node, re_t *re) {
 	for (node_t *nd = node; nd != global_head(); nd = nd->prev) {
-		if (regexec(reg, nd->s, 0, NULL, 0) != 0) {
+		if (!re_match(re, nd->s, nd->size)) {
 			ll_set_current_node(nd);
 			return nd;
 		}
@@ -187,6 +272,7 @@ node_t *ll_at(int n) {
 }
 
 node_t *ll_attach_nodes(node_t *n1, node_t *n2) {
+	rec_link(n1, n2);
 	n1->next = n2;
 	n2->prev = n1;
 	ll_set_current_node(n2);
@@ -194,6 +280,7 @@ node_t *ll_attach_nodes(node_t *n1, node_t *n2) {
 }
 
 node_t *ll_init() {
+	atexit(ll_filter_free);
 	atexit(ll_free);
 	ll_attach_nodes(&gbl_head_node, &gbl_tail_node);
 	ll_set_current_node(&gbl_head_node);
@@ -231,31 +318,32 @@ node_t *ll_last_node() {
 	return gbl_tail_node.prev;
 }
 
-/* Concatenate strings of n1 and n2, delete n2 */
-node_t *ll_join_nodes(node_t *n1, node_t *n2) {
-	n1->s[n1->size - 1] = '\0';
-	n1->size--;
-
-	size_t new_sz = n1->size + n2->size;
-
-	n1->s = realloc(n1->s, (new_sz + 1) * sizeof(*(n1->s)) );
-	if (n1->s == NULL) {
-		err(&to_repl, strerror(errno));
-	}
-	n1->size = new_sz;
-	strncat(n1->s, n2->s, n2->size);
-	ll_remove_shallow(n2);
-	ll_set_current_node(n1);
-	return n1;
+/* The size of 'node' without its newline */
+static size_t chomped(node_t *node) {
+	return node->size - (node->size > 0 && node->s[node->size - 1] == '\n');
 }
 
-void ll_cut_node(node_t *n, int where) {
-	n->s[where] = '\n';
-	n->s[where + 1] = '\0';
-	n->size = where + 1;
+node_t *ll_joined(node_t *first, node_t *last) {
+	size_t size = last->size;
+	for (node_t *node = first; node != last; node = node->next) {
+		size += chomped(node);
+	}
+	node_t *joined = ll_alloc_node(size);
+	joined->size = size;
+	char *p = joined->s;
+	for (node_t *node = first; node != last; node = node->next) {
+		memcpy(p, node->s, chomped(node));
+		p += chomped(node);
+	}
+	memcpy(p, last->s, last->size);
+	return joined;
 }
 
 int ll_node_index(node_t *node) {
+	/* An empty buffer has only line 0 */
+	if (gbl_len == 0) {
+		return ED_INDEXING - 1;
+	}
 	node = (node == global_head() ? ll_first_node() : node);
 	node = (node == global_tail() ? ll_last_node() : node);
 	node_t *i = ll_first_node();
@@ -275,25 +363,344 @@ void ll_set_current_node(node_t *node) {
 	gbl_current_node = node;
 }
 
-void ll_set_s(node_t *n, char *s) {
+void ll_set_s(node_t *n, char *s, size_t size) {
 	if (s == NULL) {
 		return;
 	}
 	n->s = s;
+	n->size = size;
+	rec_text(n);
+	filter_join(n, n);
 }
 
+/* A detached node is no longer a candidate for a global command */
 void ll_detach_node(node_t *node) {
+	node->mark = 0;
 	ll_attach_nodes(node->prev, node->next);
 }
 
-node_t *ll_make_shallow(char *s) {
+void ll_detach_range(node_t *first, node_t *last, size_t count) {
+	ll_attach_nodes(first->prev, last->next);
+	ll_set_current_node(last->next);
+	filter_stale(count);
+	gbl_len -= count;
+}
+
+void ll_splice_range(node_t *first, node_t *last, size_t count) {
+	ll_attach_nodes(first->prev, first);
+	ll_attach_nodes(last, last->next);
+	filter_stale(count);
+	gbl_len += count;
+	ll_set_current_node(last);
+}
+
+void ll_splice_after(node_t *at, node_t *first, node_t *last, size_t count) {
+	ll_attach_nodes(last, at->next);
+	ll_attach_nodes(at, first);
+	filter_stale(count);
+	gbl_len += count;
+	ll_set_current_node(last);
+}
+
+void ll_move_range(node_t *first, node_t *last, node_t *at) {
+	ll_attach_nodes(first->prev, last->next);
+	ll_attach_nodes(last, at->next);
+	ll_attach_nodes(at, first);
+	ll_set_current_node(last);
+}
+
+node_t *ll_chain(node_t *last, char *s, size_t size) {
+	node_t *node = ll_make_node(last, s, size, NULL);
+	if (last != NULL) {
+		last->next = node;
+		rec_next(last);
+	}
+	return node;
+}
+
+node_t *ll_chain_shared(node_t *last, node_t *node) {
+	node_t *copy = ll_alloc_node(0);
+	copy->s = node->s;
+	if (copy->s != NULL) {
+		TEXT(copy->s)->refs++;
+	}
+	copy->size = node->size;
+	copy->prev = last;
+	if (last != NULL) {
+		last->next = copy;
+		rec_next(last);
+	}
+	return copy;
+}
+
+_Bool ll_attached(node_t *node) {
+	if (node == global_head() || node == global_tail()) {
+		return 1;
+	}
+	return node->prev != NULL && node->prev->next == node;
+}
+
+char *ll_release_s(node_t *node) {
+	char *s = node->s;
+	node->s = NULL;
+	return s;
+}
+
+void ll_restore_s(node_t *node, char *s) {
+	node->s = s;
+	/* The log may have named the node while its string was away */
+	rec_text(node);
+}
+
+size_t ll_rec_id(node_t *node) {
+	return node->rec;
+}
+
+void ll_set_rec_id(node_t *node, size_t id) {
+	node->rec = id;
+}
+
+void ll_set_prev(node_t *node, node_t *prev) {
+	node->prev = prev;
+}
+
+void ll_set_next(node_t *node, node_t *next) {
+	node->next = next;
+}
+
+void ll_recount() {
+	gbl_len = 0;
+	for (node_t *node = ll_first_node(); node != global_tail(); 
+			node = node->next) {
+		gbl_len++;
+	}
+	filter_stale(gbl_len + 1);
+	ll_set_current_node(ll_last_node());
+}
+
+node_t *ll_make_shallow(char *s, size_t size) {
 	node_t *newnode = ll_alloc_node(0);
 	newnode->prev = NULL;
 	newnode->next = NULL;
 	newnode->s = s;
+	newnode->size = (s == NULL ? 0 : size);
 	return newnode;
 }
 
+node_t *ll_adopt_shallow(char *s, size_t size) {
+	node_t *newnode = calloc(1, sizeof(*newnode));
+	text_t *t = (newnode == NULL ? NULL : realloc(s, sizeof(*t) + size + 1));
+	if (t == NULL) {
+		free(newnode);
+		free(s);
+		return NULL;
+	}
+	memmove(t->s, t, size + 1);
+	t->refs = 1;
+	newnode->s = t->s;
+	newnode->size = size;
+	return newnode;
+}
+
+node_t *ll_replace_node(node_t *old, node_t *new) {
+	old->mark = 0;
+	ll_attach_nodes(old->prev, new);
+	ll_attach_nodes(new, old->next);
+	filter_join(new, old);
+	filter_stale(1);
+	ll_set_current_node(new);
+	return new;
+}
+
+void ll_set_mark(node_t *node, _Bool mark) {
+	node->mark = mark;
+}
+
+_Bool ll_marked(node_t *node) {
+	return node->mark;
+}
+
 ssize_t ll_len() {
 	return gbl_len;
 }
+
+
+/*
+ * SEARCH FILTERS
+ *
+ * The lines of the list are grouped in blocks of LL_FILTER_LINES consecutive
+ * lines, and each block keeps a small Bloom filter of the byte bigrams of its
+ * lines. A search for a regex whose required literal (see re_literal()) has 
+ * a bigram missing from a block's filter can skip every line of that block 
+ * without looking at their text.
+ *
+ * The filters only prefilter a walk of the list, they don't index it: a 
+ * search still visits every block, and a literal-free regex every line.
+ *
+ * Filters are built by the first search that can use them. From then on they
+ * only ever grow: a line added next to an indexed line joins its block and 
+ * adds its bigrams, a line that is removed or replaced leaves its bigrams 
+ * behind. Nodes that come back from the undo buffers still belong to their 
+ * old block, whose filter still has their bigrams. A filter is therefore 
+ * always a superset of its block. Once enough lines have been removed or 
+ * added outside any block, the whole set is marked dirty and rebuilt by the 
+ * next search; nodes from an older build (node->gen) are simply not skipped.
+ */
+
+#define LL_FILTER_LINES 64
+
+static struct {
+	/* Bits per block, a power of two; 0 disables filtering */
+	size_t bits;
+	unsigned shift;
+	unsigned gen;
+	size_t nblocks;
+	/* nblocks filters of 'bits' bits each */
+	unsigned long *words;
+	/* skip[b]: block b can't contain the literal of the current search */
+	char *skip;
+	_Bool active;
+	_Bool report;
+	size_t stale;
+} gbl_filter = { 256, 24, 0, 0, NULL, NULL, 0, 0, 0 };
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+static size_t filter_bit(unsigned char a, unsigned char b) {
+	unsigned h = (((unsigned)a << 8) | b) * 2654435761u;
+	return h >> gbl_filter.shift;
+}
+
+static unsigned long *filter_of(unsigned blk) {
+	return gbl_filter.words + blk * (gbl_filter.bits / WORD_BITS);
+}
+
+static void filter_add(node_t *node) {
+	if (node->s == NULL) {
+		return;
+	}
+	unsigned long *w = filter_of(node->blk);
+	size_t bit;
+	for (unsigned char *p = (unsigned char *)node->s; p[0] && p[1]; ++p) {
+		bit = filter_bit(p[0], p[1]);
+		w[bit / WORD_BITS] |= 1UL << (bit % WORD_BITS);
+	}
+}
+
+/* 'node' is new or has new text; put it in the block of 'neighbour' */
+static void filter_join(node_t *node, node_t *neighbour) {
+	if (gbl_filter.gen == 0) {
+		return;
+	}
+	if (neighbour->gen != gbl_filter.gen) {
+		node->gen = 0;
+		filter_stale(1);
+		return;
+	}
+	node->blk = neighbour->blk;
+	node->gen = gbl_filter.gen;
+	filter_add(node);
+}
+
+static void filter_stale(size_t lines) {
+	gbl_filter.stale += lines;
+}
+
+static void filter_build() {
+	size_t lines = 0;
+	for (node_t *nd = ll_first_node(); nd != global_tail(); nd = nd->next) {
+		lines++;
+	}
+	size_t nblocks = (lines + LL_FILTER_LINES - 1) / LL_FILTER_LINES;
+	size_t words = nblocks * (gbl_filter.bits / WORD_BITS);
+	free(gbl_filter.words);
+	free(gbl_filter.skip);
+	gbl_filter.words = calloc(words + 1, sizeof(*gbl_filter.words));
+	gbl_filter.skip = calloc(nblocks + 1, sizeof(*gbl_filter.skip));
+	if (gbl_filter.words == NULL || gbl_filter.skip == NULL) {
+		free(gbl_filter.words);
+		free(gbl_filter.skip);
+		gbl_filter.words = NULL;
+		gbl_filter.skip = NULL;
+		gbl_filter.gen = 0;
+		return;
+	}
+	gbl_filter.nblocks = nblocks;
+	gbl_filter.gen = (gbl_filter.gen + 1 == 0 ? 1 : gbl_filter.gen + 1);
+	gbl_filter.stale = 0;
+
+	size_t i = 0;
+	for (node_t *nd = ll_first_node(); nd != global_tail(); nd = nd->next, ++i) {
+		nd->blk = i / LL_FILTER_LINES;
+		nd->gen = gbl_filter.gen;
+		filter_add(nd);
+	}
+	if (gbl_filter.report) {
+		fprintf(stderr, "filters: %ld blocks of %d lines, %ld bytes\n", 
+				nblocks, LL_FILTER_LINES, ll_filter_bytes());
+	}
+}
+
+void ll_filter_config(size_t bits) {
+	gbl_filter.report = 1;
+	if (bits < WORD_BITS) {
+		gbl_filter.bits = 0;
+		return;
+	}
+	/* 
+	 * filter_bit() takes its bit from the top of a 32-bit hash of one of 
+	 * 2^16 bigrams, more bits than that can't tell them apart any better
+	 */
+	unsigned lg = 0;
+	while (lg < 16 && ((size_t)1 << (lg + 1)) <= bits) {
+		lg++;
+	}
+	gbl_filter.bits = (size_t)1 << lg;
+	gbl_filter.shift = 32 - lg;
+}
+
+size_t ll_filter_bytes() {
+	if (gbl_filter.gen == 0) {
+		return 0;
+	}
+	return gbl_filter.nblocks * (gbl_filter.bits / 8 + sizeof(*gbl_filter.skip));
+}
+
+void ll_filter_set(char *literal) {
+	gbl_filter.active = 0;
+	if (gbl_filter.bits == 0 || literal == NULL || literal[0] == '\0' || 
+			literal[1] == '\0' || gbl_len < LL_FILTER_LINES) {
+		return;
+	}
+	if (gbl_filter.gen == 0 || gbl_filter.stale > (size_t)gbl_len / 4) {
+		filter_build();
+		if (gbl_filter.gen == 0) {
+			return;
+		}
+	}
+
+	unsigned long *w;
+	size_t bit;
+	for (size_t b = 0; b < gbl_filter.nblocks; ++b) {
+		w = filter_of(b);
+		gbl_filter.skip[b] = 0;
+		for (unsigned char *p = (unsigned char *)literal; p[1]; ++p) {
+			bit = filter_bit(p[0], p[1]);
+			if (!(w[bit / WORD_BITS] & (1UL << (bit % WORD_BITS)))) {
+				gbl_filter.skip[b] = 1;
+				break;
+			}
+		}
+	}
+	gbl_filter.active = 1;
+}
+
+_Bool ll_filter_skip(node_t *node) {
+	return gbl_filter.active && node->gen == gbl_filter.gen && 
+		gbl_filter.skip[node->blk];
+}
+
+void ll_filter_free() {
+	free(gbl_filter.words);
+	free(gbl_filter.skip);
+}
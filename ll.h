@@ -11,9 +11,9 @@
  * 				node_t *next;
  * 			} node_t;
  *
- * 		ll_add_next(node, s)
- * 		ll_add_prev(node, s)
- * 		ll_make_node(prev, s, next)
+ * 		ll_add_next(node, s, size)
+ * 		ll_add_prev(node, s, size)
+ * 		ll_make_node(prev, s, size, next)
  * 		ll_remove_node(node)
  * 		ll_next(node, num)
  * 		ll_prev(node, num)
@@ -30,6 +30,9 @@
 /* The pointer type for a node in the global linked list */
 typedef struct node_t node_t;
 
+/* A compiled regex, see aux.h */
+typedef struct re_t re_t;
+
 /* Used by undo functions */
 extern node_t brake;
 
@@ -38,20 +41,82 @@ extern node_t brake;
  * Constructive Functions 
  */
 
+/* 
+ * Lines carry their size, 's' is 'size' bytes and may hold NULs. The text
+ * of a node always ends with a NUL past its size as well.
+ */
+
 /* Add a node with 's' as its value next to 'node' */
-node_t *ll_add_next(node_t *node,  char *s);
+node_t *ll_add_next(node_t *node, char *s, size_t size);
 /* Add a node with 's' as its value before 'node' */
-node_t *ll_add_prev(node_t *node,  char *s);
+node_t *ll_add_prev(node_t *node, char *s, size_t size);
 /* Return a node with 's' as its values, 'prev' and 'next' as its pointers */
-node_t *ll_make_node(node_t *prev, char *s, node_t *next);
+node_t *ll_make_node(node_t *prev, char *s, size_t size, node_t *next);
 node_t *ll_attach_nodes(node_t *n1, node_t *n2);
 /* Initialise the global list */
 node_t *ll_init();
-/* Join (Concatenate) the strings of n1 and n2 */
-node_t *ll_join_nodes(node_t *n1, node_t *n2);
+/* 
+ * Line text, shared by the nodes that copy a line, see ll.c. The string 
+ * ll_set_s(), ll_make_shallow() and ll_restore_s() take must be one of 
+ * these: ll_text_alloc() makes one of 'size' bytes, ll_text_dup() copies 
+ * 'size' bytes at 's' into one, ll_text_adopt() turns a malloc'd string 
+ * into one. ll_text_free() drops a reference.
+ */
+char *ll_text_alloc(size_t size);
+char *ll_text_dup(char *s, size_t size);
+char *ll_text_adopt(char *s, size_t size);
+void ll_text_free(char *s);
+/* 
+ * A new node, not in the list, with the lines first..last joined into one:
+ * the sizes are summed first and the text copied once
+ */
+node_t *ll_joined(node_t *first, node_t *last);
 void ll_set_current_node(node_t *node);
-void ll_set_s(node_t *n, char *s);
-node_t *ll_make_shallow(char *s);
+void ll_set_s(node_t *n, char *s, size_t size);
+node_t *ll_make_shallow(char *s, size_t size);
+/* 
+ * ll_make_shallow(ll_text_adopt(s, size), size) for worker threads: return
+ * NULL instead of raising an error. 's' is freed if it fails.
+ */
+node_t *ll_adopt_shallow(char *s, size_t size);
+/* 
+ * Take the run first..last of 'count' lines out of the list in one step. 
+ * The run stays linked and keeps pointing at its old neighbours, for 
+ * ll_splice_range() to put it back where it was, as long as they are in 
+ * the list again by then.
+ */
+void ll_detach_range(node_t *first, node_t *last, size_t count);
+void ll_splice_range(node_t *first, node_t *last, size_t count);
+/* Put the detached run first..last of 'count' lines in the list after 'at' */
+void ll_splice_after(node_t *at, node_t *first, node_t *last, size_t count);
+/* Move the run first..last after 'at', which must not be in the run */
+void ll_move_range(node_t *first, node_t *last, node_t *at);
+/* 
+ * Add a node with 's' as its value after 'last', outside the list, to build
+ * a run for ll_splice_after(). NULL starts a new run.
+ */
+node_t *ll_chain(node_t *last, char *s, size_t size);
+/* ll_chain() with a node that shares the text of 'node' */
+node_t *ll_chain_shared(node_t *last, node_t *node);
+/* Is 'node' in the global list */
+_Bool ll_attached(node_t *node);
+/* 
+ * Take the string of a detached node away, and give it back. The node keeps
+ * its size meanwhile. Used to keep the undo history out of memory.
+ */
+char *ll_release_s(node_t *node);
+void ll_restore_s(node_t *node, char *s);
+/* 
+ * For the recovery log, see rec.c: the id it knows a node by, and raw 
+ * links for its replay, which counts the lines with ll_recount() after
+ */
+size_t ll_rec_id(node_t *node);
+void ll_set_rec_id(node_t *node, size_t id);
+void ll_set_prev(node_t *node, node_t *prev);
+void ll_set_next(node_t *node, node_t *next);
+void ll_recount();
+/* Put 'new' in the place of 'old' in the list, 'old' is detached, not freed */
+node_t *ll_replace_node(node_t *old, node_t *new);
 
 /*
  * Destructive Functions
@@ -63,7 +128,6 @@ void ll_detach_node(node_t *node);
 /* Free the global list */
 void ll_free();
 void ll_free_node(node_t* node);
-void ll_cut_node(node_t *n, int where);
 
 /*
  * Lookup Functions 
@@ -73,12 +137,38 @@ node_t *ll_next(node_t *node, int offset);
 node_t *ll_prev(node_t *node, int offset);
 
 /* return the next node that matches 'reg' after 'node' */
-node_t *ll_reg_next(node_t *node, regex_t *reg);
-node_t *ll_reg_prev(node_t *node, regex_t *reg);
+node_t *ll_reg_next(node_t *node, re_t *re);
+node_t *ll_reg_prev(node_t *node, re_t *re);
+
+/* 
+ * return the first node after 'node' that matches 're', going backward if
+ * 'backward', wrapping around at either end and ending with 'node' itself 
+ */
+node_t *ll_reg_search(node_t *node, re_t *re, _Bool backward);
 
 /* return the next node that DOES NOT match 'reg' after 'node' */
-node_t *ll_reg_next_invert(node_t *node, regex_t *reg);
-node_t *ll_reg_prev_invert(node_t *node, regex_t *reg);
+node_t *ll_reg_next_invert(node_t *node, re_t *re);
+node_t *ll_reg_prev_invert(node_t *node, re_t *re);
+
+/* 
+ * Marks for global commands: set on every matching line before any command
+ * runs, cleared when a line leaves the list.
+ */
+void ll_set_mark(node_t *node, _Bool mark);
+_Bool ll_marked(node_t *node);
+
+/* 
+ * Per block bigram filters for searches, see ll.c. ll_filter_set() prepares 
+ * them for a search for 'literal' (NULL for none), after which
+ * ll_filter_skip(node) is true for lines that can't contain it. 
+ * ll_filter_skip() only reads, so workers may call it.
+ */
+void ll_filter_set(char *literal);
+_Bool ll_filter_skip(node_t *node);
+/* Set the filter size in bits per block, 0 disables filters */
+void ll_filter_config(size_t bits);
+size_t ll_filter_bytes();
+void ll_filter_free();
 
 /* Linked lists are 0 indexed */
 node_t *ll_at(int n);
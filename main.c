@@ -6,6 +6,9 @@
 #include "parse.h"
 #include "undo.h"
 #include "io.h"
+#include "rec.h"
+#include "ses.h"
+#include "err.h"
 
 jmp_buf to_repl;
 
@@ -21,8 +24,11 @@ void repl() {
 		atexit(free_repl_line);
 	}
 	setjmp(to_repl);
+	undo_recover();
+	rec_commit();
 	while (io_read_line(&repl_line, &linecap, stdin, get_prompt()) > 0) {
 		eval(parse(repl_line));
+		rec_commit();
 		if (opt_readline) {
 			free(repl_line);
 			repl_line = NULL;
@@ -39,6 +45,11 @@ int main(int argc, char *argv[]) {
 	un_fptr_init();
 	gbl_buffers_init();
 
+	/* A session brings back its own file */
+	_Bool restored = ses_open();
+	if (restored && optindex < argc) {
+		err_fatal("%s\n", "A session can't be restored along with a FILE");
+	}
 	/* The FILE argument was provided */
 	if (optindex < argc) {
 		/* FILE is a shell command, prepare the string */
@@ -54,5 +65,10 @@ int main(int argc, char *argv[]) {
 			edit_aux(argv[optindex]);
 		}
 	}
+	rec_open();
+	if (restored) {
+		/* The log can't start from the file, the session has changed it */
+		rec_checkpoint(NULL);
+	}
 	repl();
 }
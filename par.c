@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "par.h"
+
+static int gbl_nworkers = 0;
+
+typedef struct par_chunk {
+	par_fn_t fn;
+	void *arg;
+	size_t lo;
+	size_t hi;
+	int worker;
+} par_chunk;
+
+static void *par_start(void *p) {
+	par_chunk *c = p;
+	c->fn(c->arg, c->lo, c->hi, c->worker);
+	return NULL;
+}
+
+int par_nworkers() {
+	if (gbl_nworkers == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		par_set_workers(n < 1 ? 1 : (int)n);
+	}
+	return gbl_nworkers;
+}
+
+void par_set_workers(int n) {
+	if (n < 1) {
+		n = 1;
+	}
+	if (n > PAR_MAX_WORKERS) {
+		n = PAR_MAX_WORKERS;
+	}
+	gbl_nworkers = n;
+}
+
+void par_for(size_t n, par_fn_t fn, void *arg) {
+	int workers = par_nworkers();
+	if (n < PAR_THRESHOLD || workers == 1) {
+		fn(arg, 0, n, 0);
+		return;
+	}
+	/* Don't bother a thread with less than half a threshold of lines */
+	if ((size_t)workers > n / (PAR_THRESHOLD / 2)) {
+		workers = n / (PAR_THRESHOLD / 2);
+	}
+
+	pthread_t threads[PAR_MAX_WORKERS];
+	par_chunk chunks[PAR_MAX_WORKERS];
+	_Bool started[PAR_MAX_WORKERS];
+	size_t per = (n + workers - 1) / workers;
+
+	for (int w = 0; w < workers; ++w) {
+		chunks[w].fn = fn;
+		chunks[w].arg = arg;
+		chunks[w].lo = w * per;
+		chunks[w].hi = (w + 1) * per > n ? n : (w + 1) * per;
+		chunks[w].worker = w;
+		started[w] = 0;
+	}
+	/* Chunk 0 runs on the calling thread */
+	for (int w = 1; w < workers; ++w) {
+		started[w] = (pthread_create(&threads[w], NULL, par_start, &chunks[w]) == 0);
+	}
+	par_start(&chunks[0]);
+	for (int w = 1; w < workers; ++w) {
+		if (started[w]) {
+			pthread_join(threads[w], NULL);
+		}
+		else {
+			/* Could not get a thread, do the work here */
+			par_start(&chunks[w]);
+		}
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef PAR_H
+#define PAR_H
+
+#include <stddef.h>
+
+/*
+ * A small fork-join helper for work that is independent per line, like 
+ * matching a regex or building a substitution.
+ *
+ * par_for(n, fn, arg) splits the index range [0, n) into one chunk per 
+ * worker and calls fn(arg, lo, hi, worker) for each chunk, one chunk per 
+ * thread. It returns once every chunk is done. Ranges shorter than 
+ * PAR_THRESHOLD are handed to 'fn' as a single chunk on the calling thread.
+ *
+ * 'fn' must not call err_normal() or anything else that longjmps, and must 
+ * not touch the global list; it should only read the nodes it was given and
+ * write to its own slots of the output. Failures go in the output too, for
+ * the caller to raise once par_for() returns.
+ */
+
+#define PAR_THRESHOLD 4096
+#define PAR_MAX_WORKERS 64
+
+typedef void (*par_fn_t) (void *arg, size_t lo, size_t hi, int worker);
+
+void par_for(size_t n, par_fn_t fn, void *arg);
+/* Number of worker threads; defaults to the number of online processors */
+int par_nworkers();
+void par_set_workers(int n);
+
+#endif
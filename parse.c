@@ -11,6 +11,7 @@
 #include "aux.h"
 #include "undo.h"
 #include "io.h"
+#include "ses.h"
 
 
 /* 
@@ -36,6 +37,35 @@ static parse_t pt;
 
 _Bool parse_defaults = 0;
 
+/* The regex of the last /RE/ or ?RE? address */
+static re_t *gbl_address_re;
+
+static void address_re_free() {
+	re_free(gbl_address_re);
+	free(gbl_address_re);
+}
+
+static void address_re_init() {
+	if (gbl_address_re == NULL) {
+		gbl_address_re = re_make();
+		atexit(address_re_free);
+	}
+}
+
+void parse_save() {
+	ses_put_u64(gbl_address_re != NULL);
+	if (gbl_address_re != NULL) {
+		re_save(gbl_address_re);
+	}
+}
+
+void parse_load() {
+	if (ses_get_u64()) {
+		address_re_init();
+		re_load(gbl_address_re);
+	}
+}
+
 parse_t *parse(char *exp) {
 	/* defaults */
 	pt.from = global_current();
@@ -54,12 +84,52 @@ parse_t *parse(char *exp) {
 int isaddresschar(char *a) {
 	if (*a == '-' || *a == '+' || *a == '$' ||
 		*a == '.' || *a == ',' || isdigit(*a) ||
-		(isalpha(*a) && *(a-1) == '\'') || *a == '/' || *a == '\'')
+		(isalpha(*a) && *(a-1) == '\'') || *a == '/' || *a == '?' || *a == '\'')
 		return 1;
 	return 0;
 }
 
 
+/*
+ * 'addr' points at the opening delimiter of a /RE/ or ?RE? address. Search 
+ * for RE from the line after the current one, forward for '/' and backward 
+ * for '?', wrapping around the ends of the buffer, so repeated searches only
+ * cost the distance to the next match. An empty RE reuses the last one.
+ * Return the matching node, and set 'end' to the closing delimiter, or to 
+ * the last character of RE if the delimiter was left out. A closing 
+ * delimiter followed by 'I' makes the search ignore case.
+ */
+static node_t *address_search(char *addr, char **end) {
+	char delimiter = *addr;
+	char *p;
+	for (p = addr + 1; *p && *p != '\n' && *p != delimiter; ++p) {
+		if (*p == '\\' && p[1] != '\0' && p[1] != '\n') {
+			p++;
+		}
+	}
+	*end = (*p == delimiter ? p : p - 1);
+	_Bool icase = (*p == delimiter && p[1] == 'I');
+	*end += icase;
+
+	address_re_init();
+	re_set_icase(gbl_address_re, icase);
+	if (p != addr + 1) {
+		char c = *p;
+		*p = '\0';
+		parse_regex(gbl_address_re, addr + 1);
+		*p = c;
+	}
+	else if (!re_compiled(gbl_address_re)) {
+		err_normal(&to_repl, "%s\n", "No previous pattern");
+	}
+
+	node_t *node = ll_reg_search(global_current(), gbl_address_re, delimiter == '?');
+	if (node == NULL) {
+		err_normal(&to_repl, "%s\n", "No match");
+	}
+	return node;
+}
+
 /* 
  * populate the 'from' and 'to' pointers of a parse_t 
  * object, return a pointer to the expression where the 
@@ -74,11 +144,9 @@ int isaddresschar(char *a) {
  */
 char *parse_address(parse_t *pt, char *addr) {
 	bool commapassed = false;
-	regex_t reg;
 	int digits_encountered = 0;
 	for (; isaddresschar(addr); addr++) {
 		long num = 1;
-		char *start = NULL;
 		node_t *tmp;
 		parse_defaults = 0;
 		switch (*addr) {
@@ -146,21 +214,18 @@ char *parse_address(parse_t *pt, char *addr) {
 				pt->to = ll_last_node();
 				break;
 			case '/':
-				start = addr+1;
-				addr++;
-				while (*addr != '/' && *(addr-1) != '\\') {
-					addr++;
+			case '?':
+				tmp = address_search(addr, &addr);
+				if (commapassed) {
+					pt->to = tmp;
 				}
-				*addr = '\0';
-				if ((num = regcomp(&reg, start, REG_EXTENDED)) != 0) {
-					err(&to_repl, regerror_aux(num, &reg));
+				else {
+					pt->from = pt->to = tmp;
 				}
-				pt->from = pt->to = ll_reg_next(global_head(), &reg);
-				regfree(&reg);
 				break;
 			case '\'':
 				if (get_mark(*(addr+1)) == NULL) {
-					err_normal(&to_repl, "No mark set at: %c", *(addr+1));
+					err_normal(&to_repl, "No mark set at: %c\n", *(addr+1));
 				}
 				pt->from = get_mark(*(addr+1));
 				break;
@@ -269,16 +334,18 @@ void fptr_init() {
 	fp_assign('y', ed_yank);
 	fp_assign('x', ed_paste);
 	fp_assign('s', ed_subs);
+	fp_assign('C', ed_count);
 	fp_assign('g', ed_global);
 	fp_assign('G', ed_global_interact);
 	fp_assign('v', ed_global_invert);
 	fp_assign('V', ed_global_interact_invert);
 	fp_assign('u', ed_undo);
 	fp_assign('U', ed_redo);
+	fp_assign('S', ed_session);
 }
 	
-char *gbl_commands = "adcmijrwWtxsgGvVuUpn\nPf!eEjqQk=#;y";
-char *gbl_restricted_commands = "adcmijrwWtxsgGvVuU";
+char *gbl_commands = "adcmijrwWtxsgGvVuUpn\nPf!eEjqQk=#;yCS";
+char *gbl_restricted_commands = "adcmijrwWtxsgGvVuUS";
 
 void eval(parse_t *pt) {
 #if 0
@@ -288,15 +355,19 @@ void eval(parse_t *pt) {
 	printf("arguments : %s\n", pt->argument);
 	printf("size: %ld\n", ll_node_size(pt->from));
 #endif 
-	if (strchr(gbl_commands, pt->command) == NULL) {
-		err_normal(&to_repl, "%s: %c\n", "Invalid Command", pt->command);
+	eval_command(pt->from, pt->to, pt->command, pt->argument);
+}
+
+void eval_command(node_t *from, node_t *to, char cmd, char *rest) {
+	if (strchr(gbl_commands, cmd) == NULL) {
+		err_normal(&to_repl, "%s: %c\n", "Invalid Command", cmd);
 	}
 
 	if (opt_restricted) {
-		if (strchr(gbl_restricted_commands, pt->command) != NULL) {
+		if (strchr(gbl_restricted_commands, cmd) != NULL) {
 			err_normal(&to_repl, "Can't run command '%c' in"
-				   " restricted mode\n", pt->command);
+				   " restricted mode\n", cmd);
 		}
 	}
-	fptr_table[fp_hash(pt->command)](pt->from, pt->to, pt->argument);
+	fptr_table[fp_hash(cmd)](from, to, rest);
 }
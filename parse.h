@@ -48,6 +48,11 @@ extern char *gbl_commands;
 #define FPTR_ARRAY_SIZE (LAST_ASCII_CHAR - FIRST_ASCII_CHAR + 1) 
 
 void eval(parse_t *pt);
+/* eval() without a parse_t, for callers that already know the command */
+void eval_command(node_t *from, node_t *to, char cmd, char *rest);
 void fptr_init();
+/* Write the last address regex to a session image, or read it back */
+void parse_save();
+void parse_load();
 
 #endif
@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rec.h"
+#include "ll.h"
+#include "io.h"
+#include "err.h"
+#include "ed.h"
+
+/*
+ * The recovery log records what commands did to the list, not the commands
+ * themselves, so a replay costs the lines that changed whatever it took to
+ * change them.
+ *
+ * A node gets an id the first time the log needs to name it. At a
+ * checkpoint the lines of the list are numbered in order from REC_FIRST,
+ * which is how the replay numbers them when it loads the base file, and
+ * every other node becomes unknown again. A node the log hasn't named yet
+ * (a new line, or one from the undo history) is written out in full, with
+ * its text and links, before the first record that uses it.
+ *
+ * The header names the base file, with its size and mtime, and the default
+ * filename as it was at the checkpoint. After the header the log is a 
+ * sequence of records:
+ *
+ * 		'N' id size text	a new node, with its text
+ * 		'P' id id			set the prev link of a node
+ * 		'X' id id			set the next link of a node
+ * 		'L' id id			ll_attach_nodes()
+ * 		'T' id size text	the text of a node changed
+ * 		'F' id				the node was freed
+ * 		'R' size name		the default filename changed
+ * 		'E'					the command is complete
+ *
+ * The replay maps the log and applies it up to its last 'E', a command
+ * cut short by the crash is dropped. It first checks that every record 
+ * names a node that exists at that point, and afterwards that the list 
+ * leads from head to tail; a log that fails either is rejected whole. The 
+ * log is flushed at each 'E', which is enough for edd itself getting 
+ * killed; a checkpoint is synced to disk.
+ */
+
+#define REC_MAGIC "edd-rec 2\n"
+/* Ids of head and tail, the lines of the list start at REC_FIRST */
+#define REC_HEAD 0
+#define REC_TAIL 1
+#define REC_FIRST 2
+#define REC_NULL UINT64_MAX
+/* A node's id in ll.c carries the epoch it is valid for above REC_ID_BITS */
+#define REC_ID_BITS 40
+#define REC_ID_MASK (((size_t)1 << REC_ID_BITS) - 1)
+/* The log is checkpointed when it outgrows both this and the buffer */
+#define REC_MIN_CHECKPOINT ((off_t)64 << 20)
+
+static struct {
+	char *path;
+	FILE *fp;
+	/* The file the log starts from */
+	char base[PATH_MAX];
+	size_t epoch;
+	size_t next_id;
+	/* Size at which rec_commit() checkpoints */
+	off_t limit;
+	/* End of the last command in the log */
+	off_t committed;
+	/* Nodes written out by rec_known(), and the stack it walks with */
+	node_t **nodes;
+	size_t nmemb;
+	size_t sz;
+} gbl_rec;
+
+
+void rec_config(char *path) {
+	gbl_rec.path = path;
+}
+
+static void put_u64(uint64_t n) {
+	fwrite(&n, sizeof(n), 1, gbl_rec.fp);
+}
+
+static void put_text(node_t *node) {
+	char *s = ll_s(node);
+	uint64_t size = (s == NULL ? 0 : ll_node_size(node));
+	put_u64(size);
+	fwrite(s, 1, size, gbl_rec.fp);
+}
+
+static _Bool known(node_t *node) {
+	return ll_rec_id(node) >> REC_ID_BITS == gbl_rec.epoch;
+}
+
+static void set_id(node_t *node, size_t id) {
+	ll_set_rec_id(node, gbl_rec.epoch << REC_ID_BITS | id);
+}
+
+static void nodes_push(node_t *node) {
+	if (gbl_rec.nmemb == gbl_rec.sz) {
+		size_t sz = (gbl_rec.sz == 0 ? 64 : gbl_rec.sz * 2);
+		node_t **nodes = realloc(gbl_rec.nodes, sz * sizeof(*nodes));
+		if (nodes == NULL) {
+			die(strerror(errno));
+		}
+		gbl_rec.nodes = nodes;
+		gbl_rec.sz = sz;
+	}
+	gbl_rec.nodes[gbl_rec.nmemb++] = node;
+}
+
+static uint64_t id_of(node_t *node) {
+	return (node == NULL ? REC_NULL : ll_rec_id(node) & REC_ID_MASK);
+}
+
+/*
+ * Name 'node' in the log, and the unknown nodes it links to: their texts
+ * first, then their links, which may point at each other
+ */
+static uint64_t rec_known(node_t *node) {
+	if (node == NULL || known(node)) {
+		return id_of(node);
+	}
+	size_t first = gbl_rec.nmemb;
+	size_t i = first;
+	set_id(node, gbl_rec.next_id++);
+	nodes_push(node);
+	node_t *nd, *link;
+	for (; i < gbl_rec.nmemb; ++i) {
+		nd = gbl_rec.nodes[i];
+		fputc('N', gbl_rec.fp);
+		put_u64(id_of(nd));
+		put_text(nd);
+		for (int k = 0; k < 2; ++k) {
+			link = (k == 0 ? ll_prev(nd, 1) : ll_next(nd, 1));
+			if (link != NULL && !known(link)) {
+				set_id(link, gbl_rec.next_id++);
+				nodes_push(link);
+			}
+		}
+	}
+	for (i = first; i < gbl_rec.nmemb; ++i) {
+		nd = gbl_rec.nodes[i];
+		fputc('P', gbl_rec.fp);
+		put_u64(id_of(nd));
+		put_u64(id_of(ll_prev(nd, 1)));
+		fputc('X', gbl_rec.fp);
+		put_u64(id_of(nd));
+		put_u64(id_of(ll_next(nd, 1)));
+	}
+	gbl_rec.nmemb = first;
+	return id_of(node);
+}
+
+void rec_link(node_t *n1, node_t *n2) {
+	if (gbl_rec.fp == NULL) {
+		return;
+	}
+	uint64_t id1 = rec_known(n1);
+	uint64_t id2 = rec_known(n2);
+	fputc('L', gbl_rec.fp);
+	put_u64(id1);
+	put_u64(id2);
+}
+
+void rec_next(node_t *node) {
+	/* An unknown node is written out with its links when it is needed */
+	if (gbl_rec.fp == NULL || !known(node)) {
+		return;
+	}
+	uint64_t next = rec_known(ll_next(node, 1));
+	fputc('X', gbl_rec.fp);
+	put_u64(id_of(node));
+	put_u64(next);
+}
+
+void rec_text(node_t *node) {
+	if (gbl_rec.fp == NULL || !known(node)) {
+		return;
+	}
+	fputc('T', gbl_rec.fp);
+	put_u64(id_of(node));
+	put_text(node);
+}
+
+void rec_free(node_t *node) {
+	if (gbl_rec.fp == NULL || !known(node)) {
+		return;
+	}
+	fputc('F', gbl_rec.fp);
+	put_u64(id_of(node));
+}
+
+void rec_filename(char *filename) {
+	if (gbl_rec.fp == NULL) {
+		return;
+	}
+	fputc('R', gbl_rec.fp);
+	put_u64(strlen(filename));
+	fputs(filename, gbl_rec.fp);
+}
+
+void rec_commit() {
+	/* Commands that left the list alone aren't logged */
+	if (gbl_rec.fp == NULL || ftello(gbl_rec.fp) == gbl_rec.committed) {
+		return;
+	}
+	fputc('E', gbl_rec.fp);
+	fflush(gbl_rec.fp);
+	gbl_rec.committed = ftello(gbl_rec.fp);
+	if (gbl_rec.committed > gbl_rec.limit) {
+		rec_checkpoint(NULL);
+	}
+}
+
+void rec_wrote(char *filename, _Bool whole) {
+	char path[PATH_MAX];
+	if (gbl_rec.fp == NULL || realpath(filename, path) == NULL) {
+		return;
+	}
+	if (whole) {
+		rec_checkpoint(path);
+	}
+	else if (strcmp(path, gbl_rec.base) == 0) {
+		/* The log can't start from a file that no longer holds the list */
+		rec_checkpoint(NULL);
+	}
+}
+
+static char *base_snapshot() {
+	size_t len = strlen(gbl_rec.path);
+	char *base = malloc(len + sizeof(".base.tmp"));
+	if (base == NULL) {
+		return NULL;
+	}
+	sprintf(base, "%s.base.tmp", gbl_rec.path);
+	FILE *fp = fopen(base, "w");
+	if (fp == NULL) {
+		free(base);
+		return NULL;
+	}
+	for (node_t *node = ll_first_node(); node != global_tail();
+			node = ll_next(node, 1)) {
+		fwrite(ll_s(node), 1, ll_node_size(node), fp);
+	}
+	_Bool ok = (fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+	ok = (fclose(fp) == 0 && ok);
+	char *tmp = base;
+	base = malloc(len + sizeof(".base"));
+	if (base != NULL) {
+		sprintf(base, "%s.base", gbl_rec.path);
+	}
+	if (!ok || base == NULL || rename(tmp, base) != 0) {
+		remove(tmp);
+		free(tmp);
+		free(base);
+		return NULL;
+	}
+	free(tmp);
+	return base;
+}
+
+/* Number the lines of the list in order, as the replay loads them */
+static off_t number_lines() {
+	off_t bytes = 0;
+	gbl_rec.epoch++;
+	set_id(global_head(), REC_HEAD);
+	set_id(global_tail(), REC_TAIL);
+	gbl_rec.next_id = REC_FIRST;
+	for (node_t *node = ll_first_node(); node != global_tail();
+			node = ll_next(node, 1)) {
+		set_id(node, gbl_rec.next_id++);
+		bytes += ll_node_size(node);
+	}
+	return bytes;
+}
+
+void rec_checkpoint(char *base) {
+	if (gbl_rec.fp == NULL) {
+		return;
+	}
+	char *snapshot = NULL;
+	if (base == NULL && (base = snapshot = base_snapshot()) == NULL) {
+		/* Keep going with the log as it is, it is still good */
+		io_write_line(stderr, "Can't write a checkpoint for %s\n", gbl_rec.path);
+		gbl_rec.limit *= 2;
+		return;
+	}
+	char path[PATH_MAX];
+	struct stat st;
+	if (realpath(base, path) == NULL || stat(path, &st) != 0) {
+		free(snapshot);
+		return;
+	}
+	free(snapshot);
+	strcpy(gbl_rec.base, path);
+
+	fflush(gbl_rec.fp);
+	if (ftruncate(fileno(gbl_rec.fp), 0) != 0) {
+		return;
+	}
+	rewind(gbl_rec.fp);
+	fputs(REC_MAGIC, gbl_rec.fp);
+	put_u64(strlen(path));
+	fputs(path, gbl_rec.fp);
+	put_u64(st.st_size);
+	put_u64(st.st_mtim.tv_sec);
+	put_u64(st.st_mtim.tv_nsec);
+	char *filename = get_default_filename();
+	put_u64(filename == NULL ? 0 : strlen(filename));
+	if (filename != NULL) {
+		fputs(filename, gbl_rec.fp);
+	}
+	off_t bytes = number_lines();
+	gbl_rec.limit = (bytes > REC_MIN_CHECKPOINT ? bytes : REC_MIN_CHECKPOINT);
+	fflush(gbl_rec.fp);
+	fsync(fileno(gbl_rec.fp));
+	gbl_rec.committed = ftello(gbl_rec.fp);
+}
+
+/* Replay */
+
+typedef struct reader_t {
+	char *p;
+	char *end;
+} reader_t;
+
+static _Bool get_u64(reader_t *r, uint64_t *n) {
+	if ((size_t)(r->end - r->p) < sizeof(*n)) {
+		return 0;
+	}
+	memcpy(n, r->p, sizeof(*n));
+	r->p += sizeof(*n);
+	return 1;
+}
+
+static _Bool get_text(reader_t *r, char **s, uint64_t *size) {
+	if (!get_u64(r, size) || (uint64_t)(r->end - r->p) < *size) {
+		return 0;
+	}
+	*s = r->p;
+	r->p += *size;
+	return 1;
+}
+
+static struct {
+	node_t **node;
+	size_t sz;
+} gbl_ids;
+
+/* 
+ * Ids the check pass has seen made and not freed yet. The log hands out
+ * ids in order, a new node never gets one past 'next'.
+ */
+static struct {
+	_Bool *id;
+	size_t sz;
+	uint64_t next;
+} gbl_live;
+
+static _Bool live(uint64_t id) {
+	return id < gbl_live.sz && gbl_live.id[id];
+}
+
+static void live_set(uint64_t id, _Bool is_live) {
+	if (id >= gbl_live.sz) {
+		size_t sz = (gbl_live.sz == 0 ? 1024 : gbl_live.sz);
+		while (sz <= id) {
+			sz *= 2;
+		}
+		_Bool *ids = realloc(gbl_live.id, sz * sizeof(*ids));
+		if (ids == NULL) {
+			die(strerror(errno));
+		}
+		memset(ids + gbl_live.sz, 0, (sz - gbl_live.sz) * sizeof(*ids));
+		gbl_live.id = ids;
+		gbl_live.sz = sz;
+	}
+	gbl_live.id[id] = is_live;
+	if (id >= gbl_live.next) {
+		gbl_live.next = id + 1;
+	}
+}
+
+static void damaged() {
+	err_fatal("%s is damaged, remove it to start over\n", gbl_rec.path);
+}
+
+static node_t *node_at(uint64_t id) {
+	if (id == REC_NULL || id >= gbl_ids.sz) {
+		return NULL;
+	}
+	return gbl_ids.node[id];
+}
+
+static void node_set(uint64_t id, node_t *node) {
+	if (id >= gbl_ids.sz) {
+		size_t sz = (gbl_ids.sz == 0 ? 1024 : gbl_ids.sz);
+		while (sz <= id) {
+			sz *= 2;
+		}
+		node_t **nodes = realloc(gbl_ids.node, sz * sizeof(*nodes));
+		if (nodes == NULL) {
+			die(strerror(errno));
+		}
+		memset(nodes + gbl_ids.sz, 0, (sz - gbl_ids.sz) * sizeof(*nodes));
+		gbl_ids.node = nodes;
+		gbl_ids.sz = sz;
+	}
+	gbl_ids.node[id] = node;
+}
+
+/*
+ * Apply the records of 'r' if 'apply', else only check them. Returns the
+ * end of the last complete command, and counts the commands in 'commands'.
+ * The last default filename the records set goes to 'filename'.
+ */
+static char *replay(reader_t r, _Bool apply, size_t *commands, 
+		char *filename) {
+	char *done = r.p;
+	uint64_t a, b, size;
+	char *s;
+	char op;
+	node_t *node;
+	*commands = 0;
+	while (r.p < r.end) {
+		switch (op = *r.p++) {
+			case 'N':
+				if (!get_u64(&r, &a) || !get_text(&r, &s, &size)) {
+					return done;
+				}
+				if (!apply) {
+					if (a > gbl_live.next || live(a)) {
+						damaged();
+					}
+					live_set(a, 1);
+					break;
+				}
+				node = ll_make_shallow(ll_text_dup(s, size), size);
+				set_id(node, a);
+				node_set(a, node);
+				break;
+			case 'P':
+			case 'X':
+			case 'L':
+				if (!get_u64(&r, &a) || !get_u64(&r, &b)) {
+					return done;
+				}
+				if (!apply) {
+					/* Only a link may be NULL, and only a P or X one */
+					if (!live(a) || (b == REC_NULL ? op == 'L' : !live(b))) {
+						damaged();
+					}
+					break;
+				}
+				if (op == 'P') {
+					ll_set_prev(node_at(a), node_at(b));
+				}
+				else if (op == 'X') {
+					ll_set_next(node_at(a), node_at(b));
+				}
+				else {
+					ll_set_prev(node_at(b), node_at(a));
+					ll_set_next(node_at(a), node_at(b));
+				}
+				break;
+			case 'T':
+				if (!get_u64(&r, &a) || !get_text(&r, &s, &size)) {
+					return done;
+				}
+				if (!apply) {
+					if (!live(a)) {
+						damaged();
+					}
+					break;
+				}
+				ll_text_free(ll_release_s(node_at(a)));
+				ll_set_s(node_at(a), ll_text_dup(s, size), size);
+				break;
+			case 'F':
+				if (!get_u64(&r, &a)) {
+					return done;
+				}
+				if (!apply) {
+					if (a == REC_HEAD || a == REC_TAIL || !live(a)) {
+						damaged();
+					}
+					live_set(a, 0);
+					break;
+				}
+				ll_free_node(node_at(a));
+				node_set(a, NULL);
+				break;
+			case 'R':
+				if (!get_text(&r, &s, &size)) {
+					return done;
+				}
+				if (size >= PATH_MAX || memchr(s, '\0', size) != NULL) {
+					damaged();
+				}
+				if (apply) {
+					memcpy(filename, s, size);
+					filename[size] = '\0';
+				}
+				break;
+			case 'E':
+				done = r.p;
+				(*commands)++;
+				break;
+			default:
+				return done;
+		}
+	}
+	return done;
+}
+
+/*
+ * Records that each name a live node can still link them wrong. The list
+ * has to lead from head to tail, through nodes whose prev links lead back,
+ * without visiting more nodes than the replay made.
+ */
+static _Bool list_sane() {
+	size_t nodes = 0;
+	for (size_t i = 0; i < gbl_ids.sz; ++i) {
+		nodes += (gbl_ids.node[i] != NULL);
+	}
+	node_t *node = global_head();
+	for (size_t i = 0; i < nodes && node != global_tail(); ++i) {
+		if (ll_next(node, 1) == NULL || ll_prev(ll_next(node, 1), 1) != node) {
+			return 0;
+		}
+		node = ll_next(node, 1);
+	}
+	return node == global_tail();
+}
+
+/* Load 'base' in place of what the list holds */
+static void load_base(char *base) {
+	FILE *fp = fopen(base, "r");
+	if (fp == NULL) {
+		err_fatal("Can't open %s to recover %s: %s\n", base, gbl_rec.path,
+				strerror(errno));
+	}
+	node_t *node = ll_first_node();
+	while (node != global_tail()) {
+		node = ll_remove_node(node);
+	}
+	io_load_file(fp);
+	fclose(fp);
+}
+
+/* Recover from the log at 'fd', return the size of its good part */
+static off_t recover(int fd, off_t size) {
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err_fatal("Can't map %s: %s\n", gbl_rec.path, strerror(errno));
+	}
+	reader_t r = {map, map + size};
+	uint64_t len, st_size, sec, nsec;
+	char path[PATH_MAX];
+	char filename[PATH_MAX];
+	char *s;
+	struct stat st;
+	size_t magic = strlen(REC_MAGIC);
+	if (size < (off_t)magic || memcmp(map, REC_MAGIC, magic) != 0 ||
+			(r.p += magic, !get_u64(&r, &len)) || len >= PATH_MAX ||
+			(uint64_t)(r.end - r.p) < len) {
+		err_fatal("%s is not an edd recovery log\n", gbl_rec.path);
+	}
+	memcpy(path, r.p, len);
+	path[len] = '\0';
+	strcpy(gbl_rec.base, path);
+	r.p += len;
+	if (!get_u64(&r, &st_size) || !get_u64(&r, &sec) || !get_u64(&r, &nsec) ||
+			!get_text(&r, &s, &len) || len >= PATH_MAX) {
+		err_fatal("%s is not an edd recovery log\n", gbl_rec.path);
+	}
+	memcpy(filename, s, len);
+	filename[len] = '\0';
+	if (stat(path, &st) != 0 || (uint64_t)st.st_size != st_size ||
+			(uint64_t)st.st_mtim.tv_sec != sec ||
+			(uint64_t)st.st_mtim.tv_nsec != nsec) {
+		err_fatal("%s changed since %s was written, remove the log to start "
+				"over\n", path, gbl_rec.path);
+	}
+
+	char *default_filename = get_default_filename();
+	char loaded[PATH_MAX];
+	if (default_filename == NULL || realpath(default_filename, loaded) == NULL ||
+			strcmp(loaded, path) != 0) {
+		load_base(path);
+	}
+	number_lines();
+	node_set(REC_HEAD, global_head());
+	node_set(REC_TAIL, global_tail());
+	live_set(REC_HEAD, 1);
+	live_set(REC_TAIL, 1);
+	size_t id = REC_FIRST;
+	for (node_t *node = ll_first_node(); node != global_tail();
+			node = ll_next(node, 1)) {
+		live_set(id, 1);
+		node_set(id++, node);
+	}
+
+	size_t commands;
+	r.end = replay(r, 0, &commands, filename);
+	free(gbl_live.id);
+	gbl_live.id = NULL;
+	gbl_live.sz = 0;
+	gbl_live.next = 0;
+	replay(r, 1, &commands, filename);
+	if (!list_sane()) {
+		/* Nothing can walk the list now, leave its nodes to the exit */
+		ll_attach_nodes(global_head(), global_tail());
+		damaged();
+	}
+	char *end = r.end;
+	off_t good = end - map;
+	munmap(map, size);
+
+	/* Ids carry on from the highest the log used */
+	for (size_t i = gbl_ids.sz; i > 0; --i) {
+		if (gbl_ids.node[i - 1] != NULL) {
+			gbl_rec.next_id = (i > gbl_rec.next_id ? i : gbl_rec.next_id);
+			break;
+		}
+	}
+	free(gbl_ids.node);
+	gbl_ids.node = NULL;
+	gbl_ids.sz = 0;
+	ll_recount();
+	/* A FILE argument names the file, else the one the session had does */
+	if (default_filename == NULL && filename[0] != '\0') {
+		set_default_filename(filename);
+	}
+	gbl_rec.limit = REC_MIN_CHECKPOINT;
+	io_write_line(stdout, "%ld command%s recovered from %s\n", commands,
+			(commands == 1 ? "" : "s"), gbl_rec.path);
+	return good;
+}
+
+void rec_open() {
+	if (gbl_rec.path == NULL) {
+		return;
+	}
+	int fd = open(gbl_rec.path, O_RDWR | O_CREAT, 0600);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		err_fatal("Can't open %s: %s\n", gbl_rec.path, strerror(errno));
+	}
+	off_t good = 0;
+	if (st.st_size > 0) {
+		good = recover(fd, st.st_size);
+		if (ftruncate(fd, good) != 0) {
+			err_fatal("Can't open %s: %s\n", gbl_rec.path, strerror(errno));
+		}
+	}
+	gbl_rec.fp = fdopen(fd, "r+");
+	if (gbl_rec.fp == NULL) {
+		err_fatal("Can't open %s: %s\n", gbl_rec.path, strerror(errno));
+	}
+	setvbuf(gbl_rec.fp, NULL, _IOFBF, 1 << 20);
+	if (good == 0) {
+		char *filename = get_default_filename();
+		rec_checkpoint(filename != NULL && access(filename, R_OK) == 0 ?
+				filename : NULL);
+	}
+	else {
+		fseeko(gbl_rec.fp, 0, SEEK_END);
+		gbl_rec.committed = good;
+	}
+}
+
+/* 
+ * Quitting leaves nothing to recover. Every other way out, die() and 
+ * err_fatal() among them, leaves the log for the next edd -J.
+ */
+void rec_close() {
+	if (gbl_rec.fp == NULL) {
+		return;
+	}
+	fclose(gbl_rec.fp);
+	gbl_rec.fp = NULL;
+	remove(gbl_rec.path);
+	char *base = malloc(strlen(gbl_rec.path) + sizeof(".base"));
+	if (base != NULL) {
+		sprintf(base, "%s.base", gbl_rec.path);
+		remove(base);
+		free(base);
+	}
+	free(gbl_rec.nodes);
+}
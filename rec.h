@@ -0,0 +1,37 @@
+#ifndef REC_H
+#define REC_H
+
+#include "ll.h"
+
+/*
+ * The recovery log. With -J FILE every change ll.c makes to the global
+ * list is appended to FILE as it happens, a command at a time. A session
+ * that dies without quitting leaves FILE behind, and edd -J FILE replays
+ * it on top of the file it started from, see rec.c.
+ */
+
+/* Keep the log in 'path', called for -J */
+void rec_config(char *path);
+/* Start logging once the file is loaded, recovering what a crash left */
+void rec_open();
+/* The default filename is now 'filename' */
+void rec_filename(char *filename);
+/* The command that ran last is complete */
+void rec_commit();
+/* The session quit with q or Q, remove the log */
+void rec_close();
+/*
+ * The list now holds exactly what is in the file 'base', the log starts
+ * over from there. NULL writes the list to a file next to the log first.
+ */
+void rec_checkpoint(char *base);
+/* 'filename' was written, with the whole buffer if 'whole' */
+void rec_wrote(char *filename, _Bool whole);
+
+/* Called by ll.c as the list changes */
+void rec_link(node_t *n1, node_t *n2);
+void rec_next(node_t *node);
+void rec_text(node_t *node);
+void rec_free(node_t *node);
+
+#endif
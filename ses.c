@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ses.h"
+#include "ll.h"
+#include "err.h"
+#include "ed.h"
+#include "parse.h"
+#include "undo.h"
+
+/*
+ * A session image is what the buffer's data structures point at, with the
+ * pointers turned into ids. Every node a session can reach is numbered: the
+ * lines of the list in order, then the nodes the undo history and the marks
+ * hold, and the nodes their links lead to. After the header come the
+ * sections the modules write, in this order: ll (the current line), ed
+ * (buffers_save()), parse (parse_save()) and undo (undo_save()). The node
+ * table comes last, since saving the sections is what numbers the nodes:
+ *
+ * 		header		SES_MAGIC, the offset of the node table, the nodes in it
+ * 		sections	u64 numbers and (u64 size, bytes) strings
+ * 		node table	for each id in order: its text, its prev and next ids
+ *
+ * A restore maps the image and makes the nodes straight from the table,
+ * without looking for newlines or running a command again. Texts the undo
+ * journal holds are stored by undo_save() and the node table has none.
+ */
+
+#define SES_MAGIC "edd-session 3\n"
+#define SES_HEAD 0
+#define SES_TAIL 1
+#define SES_NULL UINT64_MAX
+#define SES_BRAKE (UINT64_MAX - 1)
+
+static struct {
+	/* The image given with -S */
+	char *path;
+	FILE *fp;
+	/* Ids while saving: a table of 'slots' from nodes to ids, and the nodes */
+	node_t **key;
+	uint64_t *id;
+	size_t slots;
+	node_t **node;
+	size_t nmemb;
+	size_t sz;
+	/* The part of the image read so far while restoring */
+	char *p;
+	char *end;
+} gbl_ses;
+
+void ses_config(char *path) {
+	gbl_ses.path = path;
+}
+
+/* Saving */
+
+static size_t slot_of(node_t *node) {
+	uint64_t h = ((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ULL;
+	return (h >> 32) & (gbl_ses.slots - 1);
+}
+
+static void ids_grow() {
+	size_t slots = (gbl_ses.slots == 0 ? 1024 : gbl_ses.slots * 2);
+	free(gbl_ses.key);
+	free(gbl_ses.id);
+	gbl_ses.key = calloc(slots, sizeof(*gbl_ses.key));
+	gbl_ses.id = malloc(slots * sizeof(*gbl_ses.id));
+	node_t **node = realloc(gbl_ses.node, slots / 2 * sizeof(*node));
+	if (gbl_ses.key == NULL || gbl_ses.id == NULL || node == NULL) {
+		die(strerror(errno));
+	}
+	gbl_ses.slots = slots;
+	gbl_ses.node = node;
+	gbl_ses.sz = slots / 2;
+	size_t i;
+	for (size_t id = 0; id < gbl_ses.nmemb; ++id) {
+		for (i = slot_of(node[id]); gbl_ses.key[i] != NULL;
+				i = (i + 1) & (slots - 1)) {
+		}
+		gbl_ses.key[i] = node[id];
+		gbl_ses.id[i] = id;
+	}
+}
+
+/* The id of 'node', numbering it if it has none yet */
+static uint64_t node_id(node_t *node) {
+	if (gbl_ses.nmemb == gbl_ses.sz) {
+		ids_grow();
+	}
+	size_t i;
+	for (i = slot_of(node); gbl_ses.key[i] != NULL;
+			i = (i + 1) & (gbl_ses.slots - 1)) {
+		if (gbl_ses.key[i] == node) {
+			return gbl_ses.id[i];
+		}
+	}
+	gbl_ses.key[i] = node;
+	gbl_ses.id[i] = gbl_ses.nmemb;
+	gbl_ses.node[gbl_ses.nmemb] = node;
+	return gbl_ses.nmemb++;
+}
+
+void ses_put_u64(uint64_t n) {
+	fwrite(&n, sizeof(n), 1, gbl_ses.fp);
+}
+
+void ses_put_text(char *s, size_t size) {
+	ses_put_u64(size);
+	fwrite(s, 1, size, gbl_ses.fp);
+}
+
+void ses_put_str(char *s) {
+	if (s == NULL) {
+		ses_put_u64(SES_NULL);
+		return;
+	}
+	ses_put_text(s, strlen(s));
+}
+
+void ses_put_node(node_t *node) {
+	if (node == NULL) {
+		ses_put_u64(SES_NULL);
+	}
+	else if (node == &brake) {
+		ses_put_u64(SES_BRAKE);
+	}
+	else {
+		ses_put_u64(node_id(node));
+	}
+}
+
+static void ids_free() {
+	free(gbl_ses.key);
+	free(gbl_ses.id);
+	free(gbl_ses.node);
+	gbl_ses.key = NULL;
+	gbl_ses.id = NULL;
+	gbl_ses.node = NULL;
+	gbl_ses.slots = gbl_ses.nmemb = gbl_ses.sz = 0;
+}
+
+void ses_save(char *path) {
+	if (path == NULL && (path = gbl_ses.path) == NULL) {
+		err_normal(&to_repl, "%s\n", "No session file");
+	}
+	char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+	if (tmp == NULL) {
+		err_normal(&to_repl, "%s\n", strerror(errno));
+	}
+	sprintf(tmp, "%s.tmp", path);
+	if ((gbl_ses.fp = fopen(tmp, "w")) == NULL) {
+		free(tmp);
+		err_normal(&to_repl, "Can't save the session: %s\n", strerror(errno));
+	}
+	setvbuf(gbl_ses.fp, NULL, _IOFBF, 1 << 20);
+	fputs(SES_MAGIC, gbl_ses.fp);
+	/* The node table's offset and size, filled in at the end */
+	ses_put_u64(0);
+	ses_put_u64(0);
+
+	node_id(global_head());
+	node_id(global_tail());
+	for (node_t *node = ll_first_node(); node != global_tail();
+			node = ll_next(node, 1)) {
+		node_id(node);
+	}
+	ses_put_node(global_current());
+	buffers_save();
+	parse_save();
+	undo_save();
+
+	off_t table = ftello(gbl_ses.fp);
+	node_t *node;
+	/* Links lead to more nodes as the table is written */
+	for (size_t i = 0; i < gbl_ses.nmemb; ++i) {
+		node = gbl_ses.node[i];
+		if (ll_s(node) == NULL) {
+			ses_put_u64(SES_NULL);
+		}
+		else {
+			ses_put_text(ll_s(node), ll_node_size(node));
+		}
+		ses_put_node(ll_prev(node, 1));
+		ses_put_node(ll_next(node, 1));
+	}
+	fseeko(gbl_ses.fp, strlen(SES_MAGIC), SEEK_SET);
+	ses_put_u64(table);
+	ses_put_u64(gbl_ses.nmemb);
+	ids_free();
+
+	_Bool ok = (fflush(gbl_ses.fp) == 0 && !ferror(gbl_ses.fp));
+	ok = (fclose(gbl_ses.fp) == 0 && ok);
+	gbl_ses.fp = NULL;
+	if (!ok || rename(tmp, path) != 0) {
+		int errsv = errno;
+		remove(tmp);
+		free(tmp);
+		err_normal(&to_repl, "Can't save the session: %s\n", strerror(errsv));
+	}
+	free(tmp);
+}
+
+/* Restoring */
+
+static void bad_image() {
+	err_fatal("%s is not an edd session image\n", gbl_ses.path);
+}
+
+uint64_t ses_get_u64() {
+	uint64_t n;
+	if ((size_t)(gbl_ses.end - gbl_ses.p) < sizeof(n)) {
+		bad_image();
+	}
+	memcpy(&n, gbl_ses.p, sizeof(n));
+	gbl_ses.p += sizeof(n);
+	return n;
+}
+
+/* The next text in the image, in place; NULL if it has none */
+static char *get_raw(size_t *size) {
+	uint64_t n = ses_get_u64();
+	if (n == SES_NULL) {
+		return NULL;
+	}
+	if ((uint64_t)(gbl_ses.end - gbl_ses.p) < n) {
+		bad_image();
+	}
+	char *s = gbl_ses.p;
+	gbl_ses.p += n;
+	*size = n;
+	return s;
+}
+
+static char *text_dup(char *s, size_t size) {
+	char *t = malloc(size + 1);
+	if (t == NULL) {
+		die(strerror(errno));
+	}
+	memcpy(t, s, size);
+	t[size] = '\0';
+	return t;
+}
+
+char *ses_get_text(size_t *size) {
+	char *s = get_raw(size);
+	return (s == NULL ? NULL : text_dup(s, *size));
+}
+
+char *ses_get_str() {
+	size_t size;
+	return ses_get_text(&size);
+}
+
+node_t *ses_get_node() {
+	uint64_t id = ses_get_u64();
+	if (id == SES_NULL) {
+		return NULL;
+	}
+	if (id == SES_BRAKE) {
+		return &brake;
+	}
+	if (id >= gbl_ses.nmemb) {
+		bad_image();
+	}
+	return gbl_ses.node[id];
+}
+
+/* Make the nodes of the table at 'table', 'count' of them, and link them */
+static void load_nodes(char *table, uint64_t count) {
+	if (count < SES_TAIL + 1 || count > (uint64_t)(gbl_ses.end - table)) {
+		bad_image();
+	}
+	gbl_ses.node = malloc(count * sizeof(*gbl_ses.node));
+	if (gbl_ses.node == NULL) {
+		die(strerror(errno));
+	}
+	gbl_ses.nmemb = count;
+	gbl_ses.node[SES_HEAD] = global_head();
+	gbl_ses.node[SES_TAIL] = global_tail();
+	char *s;
+	size_t size;
+	gbl_ses.p = table;
+	for (size_t i = 0; i < count; ++i) {
+		s = get_raw(&size);
+		if (i > SES_TAIL) {
+			gbl_ses.node[i] = ll_make_shallow(s == NULL ? NULL :
+					ll_text_dup(s, size), size);
+		}
+		/* The links are read once every node exists, only skip them here */
+		ses_get_u64();
+		ses_get_u64();
+	}
+	node_t *node;
+	gbl_ses.p = table;
+	for (size_t i = 0; i < count; ++i) {
+		get_raw(&size);
+		node = gbl_ses.node[i];
+		ll_set_prev(node, ses_get_node());
+		ll_set_next(node, ses_get_node());
+	}
+	ll_recount();
+}
+
+_Bool ses_open() {
+	if (gbl_ses.path == NULL) {
+		return 0;
+	}
+	int fd = open(gbl_ses.path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		err_fatal("Can't open %s: %s\n", gbl_ses.path, strerror(errno));
+	}
+	if (st.st_size == 0) {
+		bad_image();
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err_fatal("Can't map %s: %s\n", gbl_ses.path, strerror(errno));
+	}
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	gbl_ses.p = map;
+	gbl_ses.end = map + st.st_size;
+	size_t magic = strlen(SES_MAGIC);
+	if ((size_t)st.st_size < magic || memcmp(map, SES_MAGIC, magic) != 0) {
+		bad_image();
+	}
+	gbl_ses.p += magic;
+	uint64_t table = ses_get_u64();
+	uint64_t count = ses_get_u64();
+	char *sections = gbl_ses.p;
+	if (table < (uint64_t)(sections - map) || table > (uint64_t)st.st_size) {
+		bad_image();
+	}
+	load_nodes(map + table, count);
+
+	gbl_ses.p = sections;
+	gbl_ses.end = map + table;
+	ll_set_current_node(ses_get_node());
+	buffers_load();
+	parse_load();
+	undo_load();
+
+	munmap(map, st.st_size);
+	free(gbl_ses.node);
+	gbl_ses.node = NULL;
+	gbl_ses.nmemb = 0;
+	return 1;
+}
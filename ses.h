@@ -0,0 +1,34 @@
+#ifndef SES_H
+#define SES_H
+
+#include <stdint.h>
+#include "ll.h"
+
+/*
+ * Session images. 'S FILE' saves everything a session holds to FILE: the
+ * lines, the undo history, marks, the yank registers, the default filename
+ * and the last regexes; edd -S FILE starts where that session left off,
+ * see ses.c.
+ */
+
+/* Restore the image in 'path' at startup, called for -S */
+void ses_config(char *path);
+/* Restore the image given with -S, if any. Returns whether it did. */
+_Bool ses_open();
+/* Save the session to 'path', or to the image given with -S if NULL */
+void ses_save(char *path);
+
+/*
+ * For the modules that save their state in the image, in the same order
+ * as they read it back. Strings may be NULL, the ones read are malloc'd.
+ */
+void ses_put_u64(uint64_t n);
+void ses_put_str(char *s);
+void ses_put_text(char *s, size_t size);
+void ses_put_node(node_t *node);
+uint64_t ses_get_u64();
+char *ses_get_str();
+char *ses_get_text(size_t *size);
+node_t *ses_get_node();
+
+#endif
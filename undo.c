@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "undo.h"
 #include "ll.h"
 #include "parse.h"
 #include "aux.h"
 #include "err.h"
 #include "ed.h"
+#include "io.h"
+#include "ses.h"
 
 /*
  *  DATA BUFFERS
@@ -80,6 +84,15 @@
  *  	- un_ functions only push to gbl_redo_append or gbl_redo_delete.
  *  	- re_ functions only push to gbl_append_buf or gbl_delete_buf.
  *
+ * 	THE JOURNAL
+ *
+ * 	Deleted lines stay in gbl_delete_buf for as long as the session lasts.
+ * 	With a cap set (undo_journal_config()), the strings of the oldest of 
+ * 	them are written to an append-only temporary file once the lines in 
+ * 	gbl_delete_buf take more than the cap, and read back when undo pops 
+ * 	them. The nodes themselves stay, undo needs their links. Runs of the 
+ * 	range log go to the journal as one piece.
+ *
  */
 
 
@@ -99,6 +112,15 @@ static void fp_assign(fptr_t *table, char c, fptr_t fn) {
 	table[fp_hash(c)] = fn;
 }
 
+/* The function of 'table' for the record 'c'; an error if it has none */
+static fptr_t fp_lookup(fptr_t *table, char c) {
+	int i = fp_hash(c);
+	if (i < 0 || i >= FPTR_ARRAY_SIZE || table[i] == NULL) {
+		err_normal(&to_repl, "Unknown undo record: %c\n", c);
+	}
+	return table[i];
+}
+
 /* node buffers */
 
 typedef struct node_buf {
@@ -153,173 +175,502 @@ static void nb_free(nb_t *nb) {
 	free(nb->nb);
 }
 
-/* Undo buffers */
+/* Give back the memory of a buffer that is mostly empty */
+#define NB_MIN 64
+static void nb_compact(nb_t *nb) {
+	if (nb->sz <= NB_MIN || nb->nmemb >= nb->sz / 4) {
+		return;
+	}
+	size_t sz = (nb->nmemb * 2 > NB_MIN ? nb->nmemb * 2 : NB_MIN);
+	node_t **tmp = realloc(nb->nb, sz * sizeof(*tmp));
+	if (tmp == NULL) {
+		return;
+	}
+	nb->nb = tmp;
+	nb->sz = sz;
+	if (nb->initialized > sz) {
+		nb->initialized = sz;
+	}
+}
 
-typedef struct undo_t {
-	ds_t *buf;
-	/* how many undos has there been */
-	size_t undo_count;
-} undo_t;
+/* The journal */
 
-static undo_t gbl_undo_buf;
+static struct {
+	FILE *fp;
+	/* Bytes of deleted lines to keep in memory, 0 for no cap */
+	size_t cap;
+	/* Bytes of the lines in gbl_delete_buf and the range log in memory */
+	size_t bytes;
+	/* Bytes of the lines in gbl_redo_delete, always in memory */
+	size_t redo_bytes;
+	/* gbl_delete_buf.nb[0, spilled) are in the journal, at off[i] */
+	size_t spilled;
+	off_t *off;
+	size_t off_sz;
+} gbl_journal;
 
-void undo_push(undo_t *u, char c) {
-	ds_append(u->buf, c);
+void undo_journal_config(size_t cap) {
+	gbl_journal.cap = cap;
 }
 
-char undo_pop(undo_t *u) {
-	return ds_pop(u->buf);
+size_t undo_bytes() {
+	return gbl_journal.bytes + gbl_journal.redo_bytes;
 }
 
-/*******************************************************************
- * 						un_ and re_ functions                      *
- *******************************************************************/
+/* 
+ * Versions. Every record undo() takes back as one step gets an id that is 
+ * never reused, the id of the step on top of the undo side names the 
+ * state of the buffer. Only the ids are kept, not the states.
+ */
+typedef struct step_t {
+	size_t id;
+	/* Where the step's first record is in gbl_undo_buf */
+	size_t pos;
+	/* Lines and links recorded, STEP_OPEN until the step is complete */
+	size_t size;
+} step_t;
+
+#define STEP_OPEN ((size_t)-1)
 
-static void un_append() {
-	node_t *current;
-	nb_push(&gbl_redo_delete, &brake);
-	while ((current = nb_pop(&gbl_append_buf)) != &brake) {
-		ll_detach_node(current);
-		nb_push(&gbl_redo_delete, current);
+static struct {
+	step_t *step;
+	size_t sz;
+	/* Steps on the undo side */
+	size_t nmemb;
+	/* Steps on the undo and the redo side */
+	size_t top;
+	size_t last_id;
+	/* Entries pushed to the undo buffers so far, sizes the steps */
+	size_t entries;
+	/* gbl_versions.entries when the open step started */
+	size_t mark;
+} gbl_versions;
+
+/* The size of the step on top is known once nothing is added to it */
+static void version_close() {
+	if (gbl_versions.nmemb > 0 && 
+			gbl_versions.step[gbl_versions.nmemb - 1].size == STEP_OPEN) {
+		gbl_versions.step[gbl_versions.nmemb - 1].size = 
+			gbl_versions.entries - gbl_versions.mark;
 	}
 }
 
-static void re_append() {
-	node_t *current;
-	push_to_append_buf(&brake);
-	while ((current = nb_pop(&gbl_redo_delete)) != &brake) {
-		ll_attach_nodes(current, ll_next(current, 1));
-		ll_attach_nodes(ll_prev(current, 1), current);
-		push_to_append_buf(current);
+static void version_push(size_t pos) {
+	version_close();
+	if (gbl_versions.nmemb == gbl_versions.sz) {
+		size_t sz = (gbl_versions.sz == 0 ? NB_MIN : gbl_versions.sz * 2);
+		step_t *step = realloc(gbl_versions.step, sz * sizeof(*step));
+		if (step == NULL) {
+			err(&to_repl, strerror(errno));
+		}
+		gbl_versions.step = step;
+		gbl_versions.sz = sz;
 	}
+	step_t *step = &gbl_versions.step[gbl_versions.nmemb++];
+	step->id = ++gbl_versions.last_id;
+	step->pos = pos;
+	step->size = STEP_OPEN;
+	gbl_versions.mark = gbl_versions.entries;
+	gbl_versions.top = gbl_versions.nmemb;
 }
 
-static void un_delete() {
-	node_t *current;
-	nb_push(&gbl_redo_append, &brake);
-	while ((current = nb_pop(&gbl_delete_buf)) != &brake) {
-		ll_attach_nodes(current, ll_next(current, 1));
-		ll_attach_nodes(ll_prev(current, 1), current);
-		nb_push(&gbl_redo_append, current);
+size_t undo_version() {
+	return (gbl_versions.nmemb == 0 ? 0 : 
+			gbl_versions.step[gbl_versions.nmemb - 1].id);
+}
+
+/*
+ * The range log. A record of lines taken out of or put in the list in a 
+ * few contiguous runs keeps one entry per run rather than a pointer per 
+ * line. A run stays linked together and keeps pointing at its neighbours,
+ * so undo and redo put it back or take it out with two links. Records are 
+ * separated by an entry without lines, as &brake separates them in the node
+ * buffers.
+ */
+
+typedef struct range_t {
+	node_t *first;
+	node_t *last;
+	size_t count;
+	size_t bytes;
+	/* The run was put in the list, undo takes it out */
+	_Bool inserted;
+	/* Where the lines are in the journal, -1 if they are in memory */
+	off_t off;
+} range_t;
+
+static struct {
+	range_t *r;
+	size_t sz;
+	/* Entries on the undo side */
+	size_t nmemb;
+	/* Entries on the undo and the redo side */
+	size_t top;
+	/* r[0, spilled) may be in the journal */
+	size_t spilled;
+} gbl_ranges;
+
+/*
+ * Lines a record takes out right after the run its last entry took out,
+ * as a global command deleting adjacent lines one by one does, extend that
+ * run: undo puts it back with one splice.
+ */
+static _Bool range_extend(node_t *first, node_t *last, size_t count,
+		size_t bytes) {
+	if (gbl_ranges.nmemb == 0) {
+		return 0;
+	}
+	range_t *r = &gbl_ranges.r[gbl_ranges.nmemb - 1];
+	if (r->first == NULL || r->inserted || r->off != -1 ||
+			ll_next(r->last, 1) != first ||
+			ll_prev(first, 1) != ll_prev(r->first, 1)) {
+		return 0;
 	}
+	ll_set_prev(first, r->last);
+	r->last = last;
+	r->count += count;
+	r->bytes += bytes;
+	return 1;
 }
 
-/* redo_append to delete */
-static void re_delete() {
-	node_t *current;
-	push_to_delete_buf(&brake);
-	while ((current = nb_pop(&gbl_redo_append)) != &brake) {
-		ll_detach_node(current);
-		push_to_delete_buf(current);
+void push_to_range_log(node_t *first, node_t *last, size_t count, size_t bytes, 
+		_Bool inserted) {
+	if (!inserted && first != NULL && range_extend(first, last, count, bytes)) {
+		gbl_versions.entries += count;
+		gbl_journal.bytes += bytes;
+		return;
+	}
+	if (gbl_ranges.nmemb == gbl_ranges.sz) {
+		size_t sz = (gbl_ranges.sz == 0 ? NB_MIN : gbl_ranges.sz * 2);
+		range_t *r = realloc(gbl_ranges.r, sz * sizeof(*r));
+		if (r == NULL) {
+			err(&to_repl, strerror(errno));
+		}
+		gbl_ranges.r = r;
+		gbl_ranges.sz = sz;
+	}
+	range_t *r = &gbl_ranges.r[gbl_ranges.nmemb++];
+	r->first = first;
+	r->last = last;
+	r->count = count;
+	r->bytes = bytes;
+	r->inserted = inserted;
+	r->off = -1;
+	gbl_versions.entries += count;
+	gbl_ranges.top = gbl_ranges.nmemb;
+	/* Inserted lines are in the list, they aren't the undo's to keep */
+	if (!inserted) {
+		gbl_journal.bytes += bytes;
 	}
 }
 
-/*
- * change is a delete followed by an insert.
- * un_change is a delete of what was inserted and
- * insert of what was deleted
+/* Read the lines of 'r' back from the journal */
+static void range_page_in(range_t *r) {
+	if (fseeko(gbl_journal.fp, r->off, SEEK_SET) != 0) {
+		die("Can't read the undo journal");
+	}
+	size_t size;
+	char *s;
+	for (node_t *node = r->first; ; node = ll_next(node, 1)) {
+		size = ll_node_size(node);
+		s = ll_text_alloc(size);
+		if (fread(s, 1, size, gbl_journal.fp) != size) {
+			die("Can't read the undo journal");
+		}
+		ll_restore_s(node, s);
+		if (node == r->last) {
+			break;
+		}
+	}
+	r->off = -1;
+}
+
+/* Take the top entry of the range log, with its lines in memory */
+static range_t *range_pop() {
+	range_t *r = &gbl_ranges.r[--gbl_ranges.nmemb];
+	if (gbl_ranges.spilled > gbl_ranges.nmemb) {
+		gbl_ranges.spilled = gbl_ranges.nmemb;
+	}
+	if (r->first == NULL) {
+		return r;
+	}
+	if (r->inserted) {
+		gbl_journal.redo_bytes += r->bytes;
+	}
+	else if (r->off != -1) {
+		range_page_in(r);
+	}
+	else {
+		gbl_journal.bytes -= r->bytes;
+	}
+	return r;
+}
+
+/* Take the entry after the top of the range log back, for redo */
+static range_t *range_repush() {
+	range_t *r = &gbl_ranges.r[gbl_ranges.nmemb++];
+	if (r->inserted) {
+		gbl_journal.redo_bytes -= r->bytes;
+	}
+	else {
+		gbl_journal.bytes += r->bytes;
+	}
+	return r;
+}
+
+/* Is the entry after the top of the range log part of the record redone */
+static _Bool range_next() {
+	return gbl_ranges.nmemb < gbl_ranges.top && 
+		gbl_ranges.r[gbl_ranges.nmemb].first != NULL;
+}
+
+static void spill_ranges() {
+	range_t *r;
+	node_t *node;
+	while (undo_bytes() > gbl_journal.cap / 2 && 
+			gbl_ranges.spilled < gbl_ranges.nmemb) {
+		r = &gbl_ranges.r[gbl_ranges.spilled++];
+		if (r->first == NULL || r->inserted || r->off != -1) {
+			continue;
+		}
+		off_t off = ftello(gbl_journal.fp);
+		for (node = r->first; ; node = ll_next(node, 1)) {
+			if (fwrite(ll_s(node), 1, ll_node_size(node), gbl_journal.fp) != 
+					(size_t)ll_node_size(node)) {
+				/* Keep the lines, nothing is lost yet */
+				fseeko(gbl_journal.fp, off, SEEK_SET);
+				gbl_ranges.spilled--;
+				return;
+			}
+			if (node == r->last) {
+				break;
+			}
+		}
+		for (node = r->first; ; node = ll_next(node, 1)) {
+			ll_text_free(ll_release_s(node));
+			if (node == r->last) {
+				break;
+			}
+		}
+		r->off = off;
+		gbl_journal.bytes -= r->bytes;
+	}
+}
+
+static void spill_nodes() {
+	if (gbl_journal.off_sz < gbl_delete_buf.nmemb) {
+		off_t *off = realloc(gbl_journal.off, gbl_delete_buf.sz * sizeof(*off));
+		if (off == NULL) {
+			return;
+		}
+		gbl_journal.off = off;
+		gbl_journal.off_sz = gbl_delete_buf.sz;
+	}
+	node_t *node;
+	size_t size;
+	while (undo_bytes() > gbl_journal.cap / 2 && 
+			gbl_journal.spilled < gbl_delete_buf.nmemb) {
+		node = gbl_delete_buf.nb[gbl_journal.spilled];
+		size = ll_node_size(node);
+		if (node != &brake && ll_s(node) != NULL) {
+			gbl_journal.off[gbl_journal.spilled] = ftello(gbl_journal.fp);
+			if (fwrite(ll_s(node), 1, size, gbl_journal.fp) != size) {
+				break;
+			}
+			ll_text_free(ll_release_s(node));
+			gbl_journal.bytes -= size;
+		}
+		gbl_journal.spilled++;
+	}
+}
+
+/* 
+ * Write the oldest deleted lines to the journal until half the cap is left,
+ * the runs of the range log first, they make up the bulk
  */
-static void un_change() {
-	un_append();
-	un_delete();
+static void journal_spill() {
+	if (gbl_journal.cap == 0 || undo_bytes() <= gbl_journal.cap) {
+		return;
+	}
+	if (gbl_journal.fp == NULL && (gbl_journal.fp = tmpfile()) == NULL) {
+		gbl_journal.cap = 0;
+		err_normal(&to_repl, "Can't open the undo journal: %s\n", strerror(errno));
+	}
+	if (fseeko(gbl_journal.fp, 0, SEEK_END) != 0) {
+		return;
+	}
+	spill_ranges();
+	spill_nodes();
+	fflush(gbl_journal.fp);
 }
 
-static void re_change() {
-	re_delete();
-	re_append();
+/* Take the top node of gbl_delete_buf, with its string in memory */
+static node_t *delete_pop() {
+	node_t *node = nb_pop(&gbl_delete_buf);
+	if (node == &brake) {
+		return node;
+	}
+	if (gbl_delete_buf.nmemb >= gbl_journal.spilled) {
+		gbl_journal.bytes -= ll_node_size(node);
+		return node;
+	}
+	gbl_journal.spilled = gbl_delete_buf.nmemb;
+	if (ll_s(node) != NULL) {
+		return node;
+	}
+	/* Undo can't go on without the line, don't let it go half way */
+	size_t size = ll_node_size(node);
+	char *s = ll_text_alloc(size);
+	if (fseeko(gbl_journal.fp, gbl_journal.off[gbl_delete_buf.nmemb], SEEK_SET) != 0 ||
+			fread(s, 1, size, gbl_journal.fp) != size) {
+		die("Can't read the undo journal");
+	}
+	ll_restore_s(node, s);
+	return node;
 }
 
-static void un_move() {
-	node_t *move_to_subsequent = nb_pop(&gbl_append_buf);
-	node_t *move_to = nb_pop(&gbl_append_buf);
-	node_t *to_next = nb_pop(&gbl_append_buf);
-	node_t *to = nb_pop(&gbl_append_buf);
-	node_t *from = nb_pop(&gbl_append_buf);
-	node_t *from_prev = nb_pop(&gbl_append_buf);
-
-	/* Pop the brakes off */
-	nb_pop(&gbl_append_buf);
+static void redo_delete_push(node_t *node) {
+	nb_push(&gbl_redo_delete, node);
+	if (node != &brake) {
+		gbl_journal.redo_bytes += ll_node_size(node);
+	}
+}
+
+static node_t *redo_delete_pop() {
+	node_t *node = nb_pop(&gbl_redo_delete);
+	if (node != &brake) {
+		gbl_journal.redo_bytes -= ll_node_size(node);
+	}
+	return node;
+}
 
-	ll_attach_nodes(from_prev, from);
-	ll_attach_nodes(to, to_next);
-	ll_attach_nodes(move_to, move_to_subsequent);
+static void journal_free() {
+	if (gbl_journal.fp != NULL) {
+		fclose(gbl_journal.fp);
+	}
+	free(gbl_journal.off);
+	free(gbl_ranges.r);
+	free(gbl_versions.step);
+}
+
+/* Undo buffers */
+
+typedef struct undo_t {
+	ds_t *buf;
+	/* how many undos has there been */
+	size_t undo_count;
+	/* Set while redo() runs, its ed_ functions don't start a new branch */
+	_Bool redoing;
+	/* Set between the 'g' records that open and close a global command */
+	_Bool global;
+} undo_t;
+
+static undo_t gbl_undo_buf;
 
+void undo_push(undo_t *u, char c) {
+	ds_append(u->buf, c);
+}
+
+char undo_pop(undo_t *u) {
+	return ds_pop(u->buf);
+}
+
+/*******************************************************************
+ * 						un_ and re_ functions                      *
+ *******************************************************************/
+
+/* 
+ * An 'm' record holds the six nodes around each move, a global command's 
+ * moves share one record and are undone in reverse.
+ */
+static void un_move() {
+	node_t *move_to_subsequent, *move_to, *to_next, *to, *from, *from_prev;
 	nb_push(&gbl_redo_append, &brake);
-	nb_push(&gbl_redo_append, from_prev);
-	nb_push(&gbl_redo_append, from);
-	nb_push(&gbl_redo_append, to);
-	nb_push(&gbl_redo_append, to_next);
-	nb_push(&gbl_redo_append, move_to);
-	nb_push(&gbl_redo_append, move_to_subsequent);
+	while ((move_to_subsequent = nb_pop(&gbl_append_buf)) != &brake) {
+		move_to = nb_pop(&gbl_append_buf);
+		to_next = nb_pop(&gbl_append_buf);
+		to = nb_pop(&gbl_append_buf);
+		from = nb_pop(&gbl_append_buf);
+		from_prev = nb_pop(&gbl_append_buf);
+
+		ll_attach_nodes(from_prev, from);
+		ll_attach_nodes(to, to_next);
+		ll_attach_nodes(move_to, move_to_subsequent);
+
+		nb_push(&gbl_redo_append, from_prev);
+		nb_push(&gbl_redo_append, from);
+		nb_push(&gbl_redo_append, to);
+		nb_push(&gbl_redo_append, to_next);
+		nb_push(&gbl_redo_append, move_to);
+		nb_push(&gbl_redo_append, move_to_subsequent);
+	}
 }
 
 static void re_move() {
-	node_t *move_to_subsequent = nb_pop(&gbl_redo_append);
-	node_t *move_to = nb_pop(&gbl_redo_append);
-	node_t *to_next = nb_pop(&gbl_redo_append);
-	node_t *to = nb_pop(&gbl_redo_append);
-	node_t *from = nb_pop(&gbl_redo_append);
-	node_t *from_prev = nb_pop(&gbl_redo_append);
-	/* Pop the brakes off */
-	nb_pop(&gbl_redo_append);
+	node_t *move_to_subsequent, *move_to, *to_next, *to, *from, *from_prev;
+	push_to_append_buf(&brake);
+	while ((move_to_subsequent = nb_pop(&gbl_redo_append)) != &brake) {
+		move_to = nb_pop(&gbl_redo_append);
+		to_next = nb_pop(&gbl_redo_append);
+		to = nb_pop(&gbl_redo_append);
+		from = nb_pop(&gbl_redo_append);
+		from_prev = nb_pop(&gbl_redo_append);
 
-	ll_attach_nodes(from_prev, to_next);
-	ll_attach_nodes(move_to, from);
-	ll_attach_nodes(to, move_to_subsequent);	
+		ll_move_range(from, to, move_to);
 
-	push_to_append_buf(&brake);
-	push_to_append_buf(from_prev);
-	push_to_append_buf(from);
-	push_to_append_buf(to);
-	push_to_append_buf(to_next);
-	push_to_append_buf(move_to);
-	push_to_append_buf(move_to_subsequent);
-}
-
-static void un_join() {
-	node_t *c1, *c2;
-	/* cut is the size that needs to be cut from the 
-	 * rear end of the string.
-	 */
-	size_t cut = 0;
-	nb_push(&gbl_redo_append, &brake);
-	while ((c1 = nb_pop(&gbl_delete_buf)) != &brake) {
-		ll_attach_nodes(c1, ll_next(c1, 1));
-		ll_attach_nodes(ll_prev(c1, 1), c1);
-		nb_push(&gbl_redo_append, c1);
-		cut += ll_node_size(c1) - 1;
-		c2 = c1;
+		push_to_append_buf(from_prev);
+		push_to_append_buf(from);
+		push_to_append_buf(to);
+		push_to_append_buf(to_next);
+		push_to_append_buf(move_to);
+		push_to_append_buf(move_to_subsequent);
 	}
-	cut++;
-	c2 = ll_prev(c2, 1);
-	size_t sz = ll_node_size(c2);
+}
 
-	/* cut is now the index at which the newstring should end */
-	cut = sz - cut;
-	ll_cut_node(c2, cut); 
+/* 
+ * 'M' is g/RE/m$ run in bulk. gbl_append_buf holds a (previous node, first,
+ * last) triple for each run of adjacent lines moved, in the order the runs
+ * were moved to the end.
+ */
+static void un_move_bulk() {
+	node_t *first, *last, *prev;
+	nb_push(&gbl_redo_append, &brake);
+	while ((last = nb_pop(&gbl_append_buf)) != &brake) {
+		first = nb_pop(&gbl_append_buf);
+		prev = nb_pop(&gbl_append_buf);
+		ll_move_range(first, last, prev);
+		nb_push(&gbl_redo_append, prev);
+		nb_push(&gbl_redo_append, first);
+		nb_push(&gbl_redo_append, last);
+	}
 }
 
-static void re_join() {
-	node_t *from, *to, *tmp;
-	from = nb_pop(&gbl_redo_append);
-	from = ll_prev(from, 1);
-	while ((tmp = nb_pop(&gbl_redo_append)) != &brake) {
-		to = tmp;
+static void re_move_bulk() {
+	node_t *first, *last;
+	push_to_append_buf(&brake);
+	while ((last = nb_pop(&gbl_redo_append)) != &brake) {
+		first = nb_pop(&gbl_redo_append);
+		nb_pop(&gbl_redo_append);
+		push_to_append_buf(ll_prev(first, 1));
+		push_to_append_buf(first);
+		push_to_append_buf(last);
+		/* A run that ends the list is where it goes already */
+		if (last != ll_last_node()) {
+			ll_move_range(first, last, ll_last_node());
+		}
 	}
-	ed_join(from, to, NULL);
-	undo_pop(&gbl_undo_buf);
 }
 
 static void un_subs() {
 	node_t *old, *new;
 	nb_push(&gbl_redo_append, &brake);
-	nb_push(&gbl_redo_delete, &brake);
-	while (((old = nb_pop(&gbl_delete_buf)) != &brake) &&
+	redo_delete_push(&brake);
+	while (((old = delete_pop()) != &brake) &&
 			((new = nb_pop(&gbl_append_buf)) != &brake)) {
 		ll_attach_nodes(ll_prev(new, 1), old);
 		ll_attach_nodes(old, ll_next(new, 1));
 		nb_push(&gbl_redo_append, old);
-		nb_push(&gbl_redo_delete, new);
+		redo_delete_push(new);
 	}
 	nb_pop(&gbl_append_buf);
 }
@@ -328,7 +679,7 @@ static void re_subs() {
 	node_t *old, *new;
 	push_to_append_buf(&brake);
 	push_to_delete_buf(&brake);
-	while (((old = nb_pop(&gbl_redo_delete)) != &brake) &&
+	while (((old = redo_delete_pop()) != &brake) &&
 			((new = nb_pop(&gbl_redo_append)) != &brake)) {
 		ll_attach_nodes(ll_prev(new, 1), old);
 		ll_attach_nodes(old, ll_next(new, 1));
@@ -338,10 +689,38 @@ static void re_subs() {
 	nb_pop(&gbl_redo_append);
 }
 
+/* 'D' is an edit recorded in the range log */
+static void un_range() {
+	range_t *r;
+	while ((r = range_pop())->first != NULL) {
+		if (r->inserted) {
+			ll_detach_range(r->first, r->last, r->count);
+		}
+		else {
+			ll_splice_range(r->first, r->last, r->count);
+		}
+	}
+}
+
+static void re_range() {
+	range_t *r;
+	/* The entry that starts the record */
+	range_repush();
+	while (range_next()) {
+		r = range_repush();
+		if (r->inserted) {
+			ll_splice_range(r->first, r->last, r->count);
+		}
+		else {
+			ll_detach_range(r->first, r->last, r->count);
+		}
+	}
+}
+
 static void un_global() {
 	char c;
 	while ((c = undo_pop(&gbl_undo_buf)) != 'g') {
-		fptr_table_undo[fp_hash(c)]();
+		fp_lookup(fptr_table_undo, c)();
 		gbl_undo_buf.undo_count++;
 	}
 }
@@ -349,7 +728,7 @@ static void un_global() {
 static void re_global() {
 	char c;
 	while ((c = ds_false_push(gbl_undo_buf.buf)) != 'g') {
-		fptr_table_redo[fp_hash(c)]();
+		fp_lookup(fptr_table_redo, c)();
 		gbl_undo_buf.undo_count--;
 	}
 }
@@ -364,35 +743,26 @@ void un_fptr_init() {
 	gbl_undo_buf.buf = ds_make();
 	atexit(undo_buffers_free);
 	/* Undo */
-	fp_assign(fptr_table_undo, 'a', un_append);
-	fp_assign(fptr_table_undo, 'i', un_append);
-	fp_assign(fptr_table_undo, 'd', un_delete);
-	fp_assign(fptr_table_undo, 'c', un_change);
+	fp_assign(fptr_table_undo, 'D', un_range);
 	fp_assign(fptr_table_undo, 'm', un_move);
-	fp_assign(fptr_table_undo, 'j', un_join);
-	fp_assign(fptr_table_undo, 'r', un_append);
-	fp_assign(fptr_table_undo, 't', un_append);
+	fp_assign(fptr_table_undo, 'M', un_move_bulk);
 	fp_assign(fptr_table_undo, 's', un_subs);
 	fp_assign(fptr_table_undo, 'g', un_global);
 	/* Redo */
-	fp_assign(fptr_table_redo, 'a', re_append);
-	fp_assign(fptr_table_redo, 'i', re_append);
-	fp_assign(fptr_table_redo, 'd', re_delete);
-	fp_assign(fptr_table_redo, 'c', re_change);
+	fp_assign(fptr_table_redo, 'D', re_range);
 	fp_assign(fptr_table_redo, 'm', re_move);
-	fp_assign(fptr_table_redo, 'j', re_join);
-	fp_assign(fptr_table_redo, 'r', re_append);
-	fp_assign(fptr_table_redo, 't', re_append);
+	fp_assign(fptr_table_redo, 'M', re_move_bulk);
 	fp_assign(fptr_table_redo, 's', re_subs);
 	fp_assign(fptr_table_redo, 'g', re_global);
 }
 
 void push_to_append_buf(node_t *node) {
 	nb_push(&gbl_append_buf, node);
+	gbl_versions.entries += (node != &brake);
 }
 
 node_t *pop_delete_buf() {
-	return nb_pop(&gbl_delete_buf);
+	return delete_pop();
 }
 
 node_t *pop_append_buf() {
@@ -401,15 +771,115 @@ node_t *pop_append_buf() {
 
 void push_to_delete_buf(node_t *node) {
 	nb_push(&gbl_delete_buf, node);
+	gbl_versions.entries += (node != &brake);
+	if (node != NULL && node != &brake) {
+		gbl_journal.bytes += ll_node_size(node);
+	}
 }
 
-void push_to_undo_buf(char c) {
+/* 
+ * An edit after an undo makes the undone records unreachable. The lines in 
+ * gbl_redo_delete are referenced by nothing else, free them; the lines in
+ * gbl_redo_append are in the active list.
+ */
+/*
+ * The lines of the redo branch are out of the list, and undo() never leaves 
+ * '.' on a line it takes out, so none of them is current and all of them 
+ * are freed here.
+ */
+static void redo_truncate() {
+	node_t *node;
+	for (size_t i = 0; i < gbl_redo_delete.nmemb; ++i) {
+		node = gbl_redo_delete.nb[i];
+		if (node == &brake) {
+			continue;
+		}
+		clear_marks_at(node);
+		ll_free_node(node);
+	}
+	gbl_redo_delete.nmemb = 0;
+	gbl_redo_append.nmemb = 0;
+	/* Deleted runs undone are back in the list, inserted ones are garbage */
+	range_t *r;
+	for (size_t i = gbl_ranges.nmemb; i < gbl_ranges.top; ++i) {
+		r = &gbl_ranges.r[i];
+		if (r->first == NULL || !r->inserted) {
+			continue;
+		}
+		node_t *next;
+		for (node = r->first; ; node = next) {
+			next = ll_next(node, 1);
+			clear_marks_at(node);
+			ll_free_node(node);
+			if (node == r->last) {
+				break;
+			}
+		}
+	}
+	gbl_ranges.top = gbl_ranges.nmemb;
+	gbl_versions.top = gbl_versions.nmemb;
+	gbl_journal.redo_bytes = 0;
+	gbl_undo_buf.undo_count = 0;
+	nb_compact(&gbl_append_buf);
+	nb_compact(&gbl_delete_buf);
+	nb_compact(&gbl_redo_append);
+	nb_compact(&gbl_redo_delete);
+}
+
+/* 
+ * Records a global command may merge: each sub-command extends the record 
+ * of the one before it when both are of the same kind, so the undo of a 
+ * whole g/RE/ is a pass over one record instead of a record per line. The
+ * pass still relinks moved and substituted lines one at a time, only the
+ * runs of a 'D' record grow, see range_extend().
+ */
+#define UNDO_MERGE "Dms"
+
+_Bool push_to_undo_buf(char c) {
+	if (gbl_undo_buf.undo_count > 0 && !gbl_undo_buf.redoing) {
+		redo_truncate();
+	}
+	/* Every record before this one is complete, its lines are detached */
+	journal_spill();
+	if (c == 'g') {
+		gbl_undo_buf.global = !gbl_undo_buf.global;
+	}
+	else if (gbl_undo_buf.global && strchr(UNDO_MERGE, c) != NULL && 
+			ds_get_s(gbl_undo_buf.buf)[ds_nmembs(gbl_undo_buf.buf) - 1] == c) {
+		return 0;
+	}
+	/* A global command is one step, from its opening 'g' */
+	if (!gbl_undo_buf.redoing && (c == 'g' ? gbl_undo_buf.global : 
+				!gbl_undo_buf.global)) {
+		version_push(ds_nmembs(gbl_undo_buf.buf));
+	}
 	undo_push(&gbl_undo_buf, c);
+	return 1;
+}
+
+void undo_recover() {
+	gbl_undo_buf.redoing = 0;
+	if (gbl_undo_buf.global) {
+		push_to_undo_buf('g');
+	}
 }
 
 void reset_undo() {
 	gbl_undo_buf.undo_count = 0;
+	gbl_undo_buf.global = 0;
 	ds_clear(gbl_undo_buf.buf);
+	gbl_append_buf.nmemb = 0;
+	gbl_delete_buf.nmemb = 0;
+	gbl_redo_append.nmemb = 0;
+	gbl_redo_delete.nmemb = 0;
+	gbl_ranges.nmemb = 0;
+	gbl_ranges.top = 0;
+	gbl_ranges.spilled = 0;
+	gbl_versions.nmemb = 0;
+	gbl_versions.top = 0;
+	gbl_journal.bytes = 0;
+	gbl_journal.redo_bytes = 0;
+	gbl_journal.spilled = 0;
 }
 
 void undo_buffers_free() {
@@ -418,15 +888,25 @@ void undo_buffers_free() {
 	nb_free(&gbl_redo_append);
 	nb_free(&gbl_redo_delete);
 	ds_free(gbl_undo_buf.buf);
+	journal_free();
 }
 
 char undo() {
+	version_close();
 	char c = undo_pop(&gbl_undo_buf);
 	if (c == '\0') {
 		err_normal(&to_repl, "%s\n", "Already at the latest change.");
 	}
-	fptr_table_undo[fp_hash(c)]();
+	fptr_t fn = fp_lookup(fptr_table_undo, c);
+	fn();
 	gbl_undo_buf.undo_count++;
+	gbl_versions.nmemb--;
+	/* Don't leave '.' on a line the undo took out of the list */
+	node_t *current = global_current();
+	if (!ll_attached(current)) {
+		ll_set_current_node(ll_attached(ll_prev(current, 1)) ? 
+				ll_prev(current, 1) : ll_last_node());
+	}
 	return c;
 }
 
@@ -439,7 +919,219 @@ char redo() {
 	if (c == '\0') {
 		err_normal(&to_repl, "%s\n", "Already at the latest change.");
 	}
-	fptr_table_redo[fp_hash(c)]();
+	fptr_t fn = fp_lookup(fptr_table_redo, c);
+	gbl_undo_buf.redoing = 1;
+	fn();
+	gbl_undo_buf.redoing = 0;
 	gbl_undo_buf.undo_count--;
+	gbl_versions.nmemb++;
 	return c;
 }
+
+void undo_step_to(size_t n) {
+	if (n > gbl_versions.top) {
+		err_normal(&to_repl, "%s\n", "No such undo state.");
+	}
+	/* Only the current state exists, the steps in between are replayed */
+	while (gbl_versions.nmemb > n) {
+		undo();
+	}
+	while (gbl_versions.nmemb < n) {
+		redo();
+	}
+}
+
+void undo_list() {
+	version_close();
+	step_t *step;
+	io_write_line(stdout, "%c0\n", (gbl_versions.nmemb == 0 ? '*' : ' '));
+	for (size_t i = 0; i < gbl_versions.top; ++i) {
+		step = &gbl_versions.step[i];
+		io_write_line(stdout, "%c%ld\t%c\t%ld\n", 
+				(i + 1 == gbl_versions.nmemb ? '*' : ' '), i + 1, 
+				ds_get_s(gbl_undo_buf.buf)[step->pos], step->size);
+	}
+}
+
+/* 
+ * Session images, see ses.h. The undo stack goes with the records undone
+ * above its top, redo reads them there. Lines in the journal are written 
+ * after everything else, and are all in memory once the image is restored.
+ */
+
+static void nb_save(nb_t *nb) {
+	ses_put_u64(nb->nmemb);
+	for (size_t i = 0; i < nb->nmemb; ++i) {
+		ses_put_node(nb->nb[i]);
+	}
+}
+
+static void nb_load(nb_t *nb) {
+	for (size_t n = ses_get_u64(); n > 0; --n) {
+		nb_push(nb, ses_get_node());
+	}
+}
+
+/* 
+ * Write 'node' with its line, at 'off' in the journal, read into 'buf' of 
+ * '*sz' bytes; returns the offset of the next line
+ */
+static off_t journal_save(node_t *node, off_t off, char **buf, size_t *sz) {
+	size_t size = ll_node_size(node);
+	if (size > *sz && (*buf = realloc(*buf, *sz = size)) == NULL) {
+		die(strerror(errno));
+	}
+	if (fseeko(gbl_journal.fp, off, SEEK_SET) != 0 || 
+			fread(*buf, 1, size, gbl_journal.fp) != size) {
+		die("Can't read the undo journal");
+	}
+	ses_put_node(node);
+	ses_put_text(*buf, size);
+	return off + size;
+}
+
+void undo_save() {
+	/* The records undone end where the last one pushed did */
+	ses_put_str(ds_get_s(gbl_undo_buf.buf));
+	ses_put_u64(ds_nmembs(gbl_undo_buf.buf));
+	ses_put_u64(gbl_undo_buf.undo_count);
+	ses_put_u64(gbl_undo_buf.global);
+	nb_save(&gbl_append_buf);
+	nb_save(&gbl_delete_buf);
+	nb_save(&gbl_redo_append);
+	nb_save(&gbl_redo_delete);
+
+	range_t *r;
+	ses_put_u64(gbl_ranges.nmemb);
+	ses_put_u64(gbl_ranges.top);
+	for (size_t i = 0; i < gbl_ranges.top; ++i) {
+		r = &gbl_ranges.r[i];
+		ses_put_node(r->first);
+		ses_put_node(r->last);
+		ses_put_u64(r->count);
+		ses_put_u64(r->bytes);
+		ses_put_u64(r->inserted);
+	}
+
+	step_t *step;
+	ses_put_u64(gbl_versions.nmemb);
+	ses_put_u64(gbl_versions.top);
+	ses_put_u64(gbl_versions.last_id);
+	ses_put_u64(gbl_versions.entries);
+	ses_put_u64(gbl_versions.mark);
+	for (size_t i = 0; i < gbl_versions.top; ++i) {
+		step = &gbl_versions.step[i];
+		ses_put_u64(step->id);
+		ses_put_u64(step->pos);
+		ses_put_u64(step->size);
+	}
+
+	/* Lines in the journal, a node and its line each */
+	char *buf = NULL;
+	size_t sz = 0;
+	node_t *node;
+	off_t off;
+	for (size_t i = 0; i < gbl_ranges.top; ++i) {
+		r = &gbl_ranges.r[i];
+		if (r->first == NULL || r->off == -1) {
+			continue;
+		}
+		off = r->off;
+		for (node = r->first; ; node = ll_next(node, 1)) {
+			off = journal_save(node, off, &buf, &sz);
+			if (node == r->last) {
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < gbl_journal.spilled; ++i) {
+		node = gbl_delete_buf.nb[i];
+		if (node == &brake || ll_s(node) != NULL) {
+			continue;
+		}
+		journal_save(node, gbl_journal.off[i], &buf, &sz);
+	}
+	free(buf);
+	ses_put_node(NULL);
+}
+
+void undo_load() {
+	reset_undo();
+	size_t n;
+	char *s = ses_get_text(&n);
+	if (s != NULL) {
+		ds_cat_n(gbl_undo_buf.buf, s, n);
+		free(s);
+	}
+	for (n = ses_get_u64(); (size_t)ds_nmembs(gbl_undo_buf.buf) > n; ) {
+		undo_pop(&gbl_undo_buf);
+	}
+	gbl_undo_buf.undo_count = ses_get_u64();
+	gbl_undo_buf.global = ses_get_u64();
+	nb_load(&gbl_append_buf);
+	nb_load(&gbl_delete_buf);
+	nb_load(&gbl_redo_append);
+	nb_load(&gbl_redo_delete);
+
+	range_t *r;
+	size_t nmemb = ses_get_u64();
+	for (size_t i = ses_get_u64(); i > 0; --i) {
+		node_t *first = ses_get_node();
+		node_t *last = ses_get_node();
+		size_t count = ses_get_u64();
+		size_t bytes = ses_get_u64();
+		push_to_range_log(first, last, count, bytes, ses_get_u64());
+	}
+	gbl_ranges.nmemb = nmemb;
+
+	step_t *step;
+	gbl_versions.nmemb = ses_get_u64();
+	gbl_versions.top = ses_get_u64();
+	gbl_versions.last_id = ses_get_u64();
+	gbl_versions.entries = ses_get_u64();
+	gbl_versions.mark = ses_get_u64();
+	if (gbl_versions.top > gbl_versions.sz) {
+		step = realloc(gbl_versions.step, gbl_versions.top * sizeof(*step));
+		if (step == NULL) {
+			die(strerror(errno));
+		}
+		gbl_versions.step = step;
+		gbl_versions.sz = gbl_versions.top;
+	}
+	for (size_t i = 0; i < gbl_versions.top; ++i) {
+		step = &gbl_versions.step[i];
+		step->id = ses_get_u64();
+		step->pos = ses_get_u64();
+		step->size = ses_get_u64();
+	}
+
+	node_t *node;
+	size_t size;
+	while ((node = ses_get_node()) != NULL) {
+		s = ses_get_text(&size);
+		ll_set_s(node, ll_text_adopt(s, size), size);
+	}
+
+	/* What push_to_range_log() and push_to_delete_buf() would have counted */
+	gbl_journal.bytes = 0;
+	gbl_journal.redo_bytes = 0;
+	for (size_t i = 0; i < gbl_delete_buf.nmemb; ++i) {
+		if (gbl_delete_buf.nb[i] != &brake) {
+			gbl_journal.bytes += ll_node_size(gbl_delete_buf.nb[i]);
+		}
+	}
+	for (size_t i = 0; i < gbl_redo_delete.nmemb; ++i) {
+		if (gbl_redo_delete.nb[i] != &brake) {
+			gbl_journal.redo_bytes += ll_node_size(gbl_redo_delete.nb[i]);
+		}
+	}
+	for (size_t i = 0; i < gbl_ranges.top; ++i) {
+		r = &gbl_ranges.r[i];
+		if (i < gbl_ranges.nmemb && !r->inserted) {
+			gbl_journal.bytes += r->bytes;
+		}
+		else if (i >= gbl_ranges.nmemb && r->inserted) {
+			gbl_journal.redo_bytes += r->bytes;
+		}
+	}
+}
@@ -9,10 +9,47 @@ void push_to_append_buf(node_t *node);
 node_t *pop_append_buf();
 void push_to_delete_buf(node_t *node);
 node_t *pop_delete_buf();
-void push_to_undo_buf(char c);
+/* 
+ * Start a record of kind 'c'. Returns 0 when a global command's record of 
+ * the same kind is extended instead, the caller then skips its separators.
+ */
+_Bool push_to_undo_buf(char c);
+/* Close what an error left open, called when control is back in the repl */
+void undo_recover();
+/* 
+ * Record the run first..last, 'count' lines and 'bytes' long, that was just
+ * taken out of the list, or put in it if 'inserted'; a run with no lines 
+ * starts a record
+ */
+void push_to_range_log(node_t *first, node_t *last, size_t count, size_t bytes, 
+		_Bool inserted);
 void reset_undo();
+/* Keep at most 'cap' bytes of deleted lines in memory, 0 for no limit */
+void undo_journal_config(size_t cap);
+/* Bytes of deleted lines held in memory for undo and redo */
+size_t undo_bytes();
 void undo_buffers_free();
+/* 
+ * The id of the state of the buffer, 0 for the one after reset_undo(). 
+ * Undo and redo come back to the same ids, a new edit gets a new one.
+ */
+size_t undo_version();
 char undo();
+/* 
+ * Undo or redo steps, one at a time, until the buffer is in the state after
+ * the first 'n' steps of the history. It costs what the same u or U 
+ * commands typed by hand would.
+ */
+void undo_step_to(size_t n);
+/* 
+ * Print the history, a step per line: its number, the kind of its first 
+ * record and how many lines and links it recorded. '*' marks the current
+ * state.
+ */
+void undo_list();
 char redo();
+/* Write the undo history to a session image, or read it back, see ses.h */
+void undo_save();
+void undo_load();
 
 #endif